@@ -35,8 +35,19 @@ extern "C" {
 #endif
  
 void mod_transform_set_XSLT(request_rec* r, const char* name) ;
+/**
+ * Have the XSLT filter transform doc instead of parsing the body.  Call it
+ * before passing anything down the filters; what the handler passes then
+ * (at least an EOS bucket) is discarded.  The request owns doc from then
+ * on and frees it once transformed, or with its pool.
+ */
 void mod_transform_XSLTDoc(request_rec* r, xmlDocPtr doc) ;
 
+/* For extension functions: what a transform read from the request */
+void mod_transform_used_header(request_rec* r, const char* name) ;
+void mod_transform_used_arg(request_rec* r, const char* name) ;
+void mod_transform_uncacheable(request_rec* r) ;
+
 typedef struct {
     int (*plugin_init)(apr_pool_t *p, int argc, const char **argv);
     int (*post_config)(apr_pool_t *p, int argc, const char **argv);
@@ -31,6 +31,9 @@
 
 #define APACHEFS_FILTER_NAME "transform_store_brigade"
 
+/* SetHandler for files to be sent straight to the XSLT filter */
+#define TRANSFORM_FILE_HANDLER "transform-xslt"
+
 #include "http_config.h"
 #include "http_protocol.h"
 #include "http_core.h"
@@ -41,6 +44,10 @@
 #include "apr_uri.h"
 #include "apr_tables.h"
 #include "apr_dso.h"
+#include "apr_hash.h"
+#include "apr_file_info.h"
+#include "apr_thread_mutex.h"
+#include "apr_atomic.h"
 
 #include <libxml/globals.h>
 #include <libxml/threads.h>
@@ -63,19 +70,85 @@ extern module AP_MODULE_DECLARE_DATA transform_module;
 #define NO_OPTIONS          (1 <<  0)
 #define USE_APACHE_FS       (1 <<  1)
 #define XINCLUDES           (1 <<  2)
+#define CACHE_INPUT         (1 <<  3)
+#define CACHE_DOCUMENTS     (1 <<  4)
+#define NATIVE_OUTPUT       (1 <<  5)
 
 /* Extension Namespace */
 #define TRANSFORM_APACHE_NAMESPACE ((const xmlChar *) "http://outoforder.cc/apache")
+/* Namespace of the http plugin's functions */
+#define TRANSFORM_HTTP_NAMESPACE ((const xmlChar *) "http://opensource.surakware.com/wiki/apache")
+
+/* Cache-Control sent with responses only made from files */
+#define TRANSFORM_CACHE_CONTROL_DEFAULT "public, max-age=0"
+
+/* A file a compiled stylesheet was built from, and its identity at the time */
+typedef struct transform_xslt_dep
+{
+    const char *path;
+    apr_time_t mtime;
+    apr_ino_t inode;
+    apr_off_t size;
+}
+transform_xslt_dep;
 
-/* Static Style Sheet Caching */
+/* A compiled stylesheet, shared by reference count */
+typedef struct transform_xslt_entry
+{
+    const char *path;
+    xsltStylesheetPtr transform;
+    apr_array_header_t *deps;
+    apr_pool_t *pool;
+    apr_size_t size;            /* estimated footprint in bytes */
+    int pure;                   /* output only depends on input and files */
+    volatile apr_uint32_t output_size;  /* running average of responses */
+    volatile apr_uint32_t refcount;
+    volatile apr_uint32_t freed;
+    /* Runtime cache only, guarded by its lock */
+    struct svr_cfg *owner;
+    struct transform_xslt_entry *lru_prev;
+    struct transform_xslt_entry *lru_next;
+}
+transform_xslt_entry;
+
+/* One stylesheet of a pipeline, and the cache entry it came from if any */
+typedef struct transform_stage
+{
+    xsltStylesheetPtr transform;
+    transform_xslt_entry *entry;
+}
+transform_stage;
+
+/* Static Style Sheet Caching (TransformCache) */
 typedef struct transform_xslt_cache
 {
     const char *id;
-    xsltStylesheetPtr transform;
+    const char *path;
+    transform_xslt_entry *volatile current;
     struct transform_xslt_cache *next;
 }
 transform_xslt_cache;
 
+/**
+ * Immutable open addressing index over the transform_xslt_cache list.
+ * It is built once the configuration has been read and swapped in
+ * atomically, so request threads can read whichever snapshot they see
+ * without locking.
+ */
+typedef struct transform_xslt_slot
+{
+    unsigned int hash;
+    transform_xslt_cache *entry;
+}
+transform_xslt_slot;
+
+typedef struct transform_xslt_index
+{
+    unsigned int mask;
+    transform_xslt_slot *slots;
+}
+transform_xslt_index;
+
 typedef struct transform_plugin_info {
     const char *name;
     int argc;
@@ -91,6 +164,11 @@ transform_plugin_info_t;
 typedef struct svr_cfg
 {
     transform_xslt_cache *data;
+    transform_xslt_index *volatile index;
+    int reload;
+    apr_off_t cache_max_bytes;
+    apr_size_t cache_bytes;
+    apr_off_t input_max_bytes;
     int announce;
     transform_plugin_info_t *plugins;
 }
@@ -99,10 +177,18 @@ svr_cfg;
 typedef struct dir_cfg
 {
     const char *xslt;
+    apr_array_header_t *stages; /* TransformSet stylesheets after xslt */
     const char *default_xslt;
     apr_int32_t opts;
     apr_int32_t incremented_opts;
     apr_int32_t decremented_opts;
+    const char *output_cache;
+    apr_interval_time_t output_wait;
+    const char *cache_control;  /* "" when off */
+    apr_size_t input_chunk;     /* 0 when unset */
+    apr_array_header_t *stream; /* TransformStream record path, root first;
+                                 * empty when Off */
+    const char *stream_wrapper; /* element written around the records */
 }
 dir_cfg;
 
@@ -110,14 +196,78 @@ typedef struct
 {
     const char *xslt;
     xmlDocPtr document;
+    apr_array_header_t *deps;   /* files read while transforming */
+    apr_table_t *conditionals;  /* hidden from the handler */
+    apr_array_header_t *uses;   /* request data read, "H<header>"/"A<arg>" */
+    int uncacheable;            /* read something no key can describe */
+    apr_array_header_t *loaded; /* documents handed out by CacheDocuments */
 }
 transform_notes;
 
+/* A response being written to the TransformOutputCache directory */
+typedef struct transform_spool
+{
+    apr_pool_t *pool;
+    const char *dir;
+    const char *key;            /* of what every variant depends on */
+    const char *base;           /* path for that key */
+    const char *path;           /* where this response goes */
+    const char *tmp_path;
+    apr_file_t *file;
+    apr_off_t length;
+    int failed;
+    const char *meta;           /* set once committed */
+    apr_file_t *lock;           /* held while producing it */
+    const char *collapse;       /* path of the variant others wait for */
+    int leader;
+}
+transform_spool;
+
+/* A parsed file, kept by TransformOptions CacheInput or CacheDocuments */
+typedef struct transform_input
+{
+    const char *key;
+    apr_pool_t *pool;
+    xmlDocPtr doc;              /* never transformed, only copied */
+    apr_time_t mtime;
+    apr_ino_t inode;
+    apr_off_t size;
+    apr_array_header_t *deps;   /* transform_xslt_dep of what it XIncluded */
+    apr_array_header_t *spare;  /* copies nobody is using */
+    apr_size_t bytes;           /* estimated, of each copy */
+    apr_time_t used;
+    int busy;                   /* copies out */
+    int gone;                   /* no longer in the table */
+    /* Only for documents kept with the key tables of a pure stylesheet */
+    struct transform_xslt_entry *xslt;
+    void *keys;                 /* xsltKeyTablePtr, shared read-only */
+    int nbkeys;
+    struct transform_input *next;       /* same stylesheet */
+}
+transform_input;
+
+#define TRANSFORM_INPUT_MAX_BYTES_DEFAULT (32 * 1024 * 1024)
+
+/* Smaller buckets are gathered up to this much before being parsed */
+#define TRANSFORM_INPUT_CHUNK_DEFAULT (32 * 1024)
+
+/* How long to wait for an identical request to produce a response */
+#define TRANSFORM_OUTPUT_WAIT_DEFAULT apr_time_from_sec(10)
+
+/* Output is passed on whenever this much is waiting */
+#define TRANSFORM_OUTPUT_CHUNK (64 * 1024)
 
 typedef struct
 {
     ap_filter_t *next;
     apr_bucket_brigade *bb;
+    transform_spool *spool;
+    apr_size_t pending;         /* bytes in bb */
+    int passed;                 /* something went down the chain already */
+    char *buf;                  /* filled, then handed over as a heap bucket */
+    apr_size_t size;
+    apr_size_t used;
+    apr_size_t hint;            /* expected size of the response, or 0 */
 }
 transform_xmlio_output_ctx;
 
@@ -133,18 +283,69 @@ typedef struct
 }
 transform_xmlio_input_ctx;
 
+apr_status_t transform_io_child_init(apr_pool_t *p, server_rec *s);
+
 apr_status_t transform_apachefs_filter(ap_filter_t * f,
                                        apr_bucket_brigade * bb);
 
 xmlParserInputBufferPtr transform_get_input(const char *URI,
                                             xmlCharEncoding enc);
+void transform_add_dep(request_rec *r, const char *filename);
 
 
 
-void *transform_cache_get(svr_cfg * sconf, const char *descriptor);
+transform_xslt_entry *transform_cache_get(svr_cfg * sconf,
+                                          const char *descriptor);
+void transform_cache_index(apr_pool_t *p, svr_cfg * conf);
 apr_status_t transform_cache_free(void *conf);
 const char *transform_cache_add(cmd_parms * cmd, void *cfg, const char *url,
                                 const char *path);
+apr_status_t transform_cache_compile(apr_pool_t *p, apr_pool_t *ptemp,
+                                     server_rec *s);
+
+apr_status_t transform_cache_child_init(apr_pool_t *p, server_rec *s);
+const char *transform_cache_resolve(ap_filter_t * f, const char *name);
+transform_xslt_entry *transform_cache_acquire(request_rec *r,
+                                              const char *path);
+void transform_cache_release(transform_xslt_entry *entry);
+int transform_cache_status(request_rec *r);
+
+int transform_output_lookup(ap_filter_t * f, apr_bucket_brigade * bb,
+                            transform_spool ** spool);
+void transform_spool_write(transform_spool * spool, const char *buffer,
+                           apr_size_t len);
+void transform_spool_commit(request_rec *r, transform_spool * spool,
+                            apr_array_header_t *deps);
+void transform_spool_compress(request_rec *r, transform_spool * spool);
+apr_status_t transform_output_child_init(apr_pool_t *p, server_rec *s);
+void transform_output_hide_conditionals(request_rec *r);
+int transform_output_static(ap_filter_t * f, apr_bucket_brigade * bb);
+int transform_output_conditional(ap_filter_t * f, apr_bucket_brigade * bb);
+int transform_output_preconditions(ap_filter_t * f);
+apr_array_header_t *transform_output_deps(request_rec *r,
+                                          apr_array_header_t *stages);
+void transform_output_validators(request_rec *r, apr_array_header_t *deps);
+void transform_output_vary(request_rec *r);
+
+apr_status_t transform_fragment_child_init(apr_pool_t *p, server_rec *s);
+
+int transform_input_lookup(ap_filter_t * f, apr_bucket_brigade * bb,
+                           xmlDocPtr * doc, transform_input ** input);
+void transform_input_include(ap_filter_t * f, xmlDocPtr doc, int cacheable,
+                             transform_input ** input);
+void transform_input_release(transform_input * input, xmlDocPtr doc,
+                             int reusable);
+int transform_serialize(xmlOutputBufferPtr out, xmlDocPtr result,
+                        xsltStylesheetPtr style, int *length);
+apr_status_t transform_serialize_child_init(apr_pool_t *p, server_rec *s);
+
+apr_array_header_t *transform_input_attach(request_rec *r,
+                                           xsltTransformContextPtr tcontext,
+                                           transform_xslt_entry * entry);
+void transform_input_finish(request_rec *r, xsltTransformContextPtr tcontext,
+                            transform_xslt_entry * entry,
+                            apr_array_header_t *attached, int ok);
+apr_status_t transform_input_child_init(apr_pool_t *p, server_rec *s);
 
 #endif /* _MOD_TRANSFORM_PRIVATE_H */
 /* vim:ai:et:ts=4:nowrap
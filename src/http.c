@@ -56,6 +56,7 @@ static void httpRemoteIP(xmlXPathParserContextPtr ctxt, int nargs) {
 		return;
 	}
 
+	mod_transform_uncacheable(FFilter->r);
 	xmlXPathReturnString(ctxt, xmlStrdup((xmlChar *)FFilter->r->connection->remote_ip));
 }
 
@@ -69,6 +70,7 @@ static void httpRemotePort(xmlXPathParserContextPtr ctxt, int nargs) {
 		return;
 	}
 
+	mod_transform_uncacheable(FFilter->r);
 	xmlXPathReturnNumber(ctxt, FFilter->r->connection->remote_addr->port);
 }
 
@@ -86,6 +88,7 @@ static void httpRequestHeader(xmlXPathParserContextPtr ctxt, int nargs) {
 	}
 
 	name = xmlXPathPopString(ctxt);
+	mod_transform_used_header(FFilter->r, (const char *)name);
 	value = (xmlChar *)apr_table_get(FFilter->r->headers_in, (const char *)name);
 
 	if (value != NULL)
@@ -112,11 +115,15 @@ static void httpGet(xmlXPathParserContextPtr ctxt, int nargs) {
 	}
 
 	key = xmlXPathPopString(ctxt);
+	mod_transform_used_arg(FFilter->r, (const char *)key);
 
 	if (FGetArgs) {
 		value = (xmlChar *)apr_table_get(FGetArgs, (const char *)key);
 	}
 	if (!value && FPostArgs) {
+		/* a request body is not part of any cache key */
+		if (FFilter->r->method_number != M_GET)
+			mod_transform_uncacheable(FFilter->r);
 		value = (xmlChar *)apr_table_get(FPostArgs, (const char *)key);
 	}
 
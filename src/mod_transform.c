@@ -23,13 +23,24 @@
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+/* For core_dir_config, which httpd before 2.4 keeps private */
+#define CORE_PRIVATE
+
 #include "mod_depends.h"
 #include "mod_transform.h"
 #include "mod_transform_private.h"
 #include <libxslt/extensions.h>
+#include <libxslt/imports.h>
 #include <libxml/xpathInternals.h>
+#include <libxml/parserInternals.h>
+#include <libxml/SAX2.h>
+#include <libxml/HTMLtree.h>
 #include <apr_dso.h>
+#include <apr_lib.h>
+#include <apr_mmap.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
 
 static void transform_error_cb(void *ctx, const char *msg, ...)
 {
@@ -69,6 +80,123 @@ static xmlNodePtr find_stylesheet_node(xmlDocPtr doc)
     return NULL;
 }
 
+/**
+ * Pull the href out of a xml-stylesheet PI.  Returns NULL when the PI does
+ * not name an external XSLT (wrong type, or a "#fragment" pointing into
+ * the document itself), in which case xsltLoadStylesheetPI has to cope.
+ */
+static const char *find_stylesheet_href(apr_pool_t *p, xmlNodePtr pi_node)
+{
+    const char *cur = (const char *) pi_node->content;
+    const char *href = NULL;
+    const char *type = NULL;
+
+    while (*cur) {
+        const char *name;
+        const char *end;
+        char quote;
+        apr_size_t len;
+
+        while (apr_isspace(*cur))
+            cur++;
+        name = cur;
+        while (*cur && *cur != '=' && !apr_isspace(*cur))
+            cur++;
+        len = cur - name;
+        while (apr_isspace(*cur))
+            cur++;
+        if (*cur++ != '=')
+            return NULL;
+        while (apr_isspace(*cur))
+            cur++;
+        quote = *cur++;
+        if (quote != '"' && quote != '\'')
+            return NULL;
+        end = strchr(cur, quote);
+        if (!end)
+            return NULL;
+
+        if (len == 4 && !strncmp(name, "href", 4))
+            href = apr_pstrndup(p, cur, end - cur);
+        else if (len == 4 && !strncmp(name, "type", 4))
+            type = apr_pstrndup(p, cur, end - cur);
+        cur = end + 1;
+    }
+
+    if (!href || href[0] == '#' || !type)
+        return NULL;
+    if (strcmp(type, "text/xsl") && strcmp(type, "text/xml")
+        && strcmp(type, "application/xslt+xml"))
+        return NULL;
+    return href;
+}
+
+/**
+ * Compile a stylesheet by name.  Names that map onto a local file go
+ * through the per child runtime cache, and *entry is set so the caller
+ * can release it; anything else is compiled from scratch as before.
+ */
+static xsltStylesheetPtr load_stylesheet(ap_filter_t * f, const char *name,
+                                         transform_xslt_entry ** entry)
+{
+    const char *path = transform_cache_resolve(f, name);
+
+    if (path) {
+        *entry = transform_cache_acquire(f->r, path);
+        return *entry ? (*entry)->transform : NULL;
+    }
+    return xsltParseStylesheetFile((const xmlChar *) name);
+}
+
+static void unload_stylesheet(xsltStylesheetPtr transform,
+                              transform_xslt_entry * entry)
+{
+    if (entry)
+        transform_cache_release(entry);
+    else
+        xsltFreeStylesheet(transform);
+}
+
+static void unload_stages(apr_array_header_t *stages)
+{
+    transform_stage *stage = (transform_stage *) stages->elts;
+    int i;
+
+    for (i = 0; i < stages->nelts; i++, stage++)
+        unload_stylesheet(stage->transform, stage->entry);
+}
+
+/**
+ * Load the stylesheets of a TransformSet pipeline after the first one.
+ * Returns 0, with whatever was loaded released, if any of them fails.
+ */
+static int load_stages(ap_filter_t * f, apr_array_header_t *names,
+                       apr_array_header_t *stages)
+{
+    svr_cfg *sconf = ap_get_module_config(f->r->server->module_config,
+                                          &transform_module);
+    transform_stage *stage;
+    const char *name;
+    int i;
+
+    for (i = 0; names && i < names->nelts; i++) {
+        name = APR_ARRAY_IDX(names, i, const char *);
+        stage = apr_array_push(stages);
+        if ((stage->entry = transform_cache_get(sconf, name))) {
+            stage->transform = stage->entry->transform;
+        }
+        else {
+            stage->transform = load_stylesheet(f, name, &stage->entry);
+        }
+        if (!stage->transform) {
+            stages->nelts--;
+            unload_stages(stages);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static void transformApacheGetFunction (xmlXPathParserContextPtr ctxt, int nargs)
 {
     if (nargs != 1) {
@@ -83,6 +211,7 @@ static void transformApacheGetFunction (xmlXPathParserContextPtr ctxt, int nargs
 
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
             "mod_transform: Warning, Using deprecated XPath HTTP get() function! Fix your XSLT!");
+        mod_transform_used_arg(r, (const char *) variable);
 
         if (r->args) {
             char found = 0;
@@ -132,18 +261,60 @@ static void transformApacheGetFunction (xmlXPathParserContextPtr ctxt, int nargs
     }
 }
 
-static apr_status_t transform_run(ap_filter_t * f, xmlDocPtr doc)
+/**
+ * TransformStream: each record, an element at the end of the configured
+ * path, is cut out of the document as soon as the parser has all of it
+ * and transformed on its own, so only one record is in memory at a time.
+ */
+typedef struct
 {
-    size_t length;
+    ap_filter_t *f;
+    xmlSAXHandler sax;
+    apr_array_header_t *path;   /* element names from the root down */
+    int depth;                  /* elements open */
+    int matched;                /* how many of those are on the path */
+    int begun;                  /* stylesheets chosen */
+    int done;                   /* stopped, ignore the rest of the input */
+    int records;                /* transformed so far */
+    apr_array_header_t *stages;
+    xsltStylesheetPtr transform;        /* the last of the stages */
     transform_xmlio_output_ctx output_ctx;
-    int stylesheet_is_cached = 0;
+    xmlOutputBufferPtr output;
+    apr_status_t status;
+}
+transform_stream;
+
+typedef struct
+{
+    xmlParserCtxtPtr ctxt;
+    transform_stream *stream;   /* TransformStream, when on */
+    int done;                   /* response already sent, drop the input */
+    int validate;               /* made from static files only */
+    transform_spool *spool;
+    int cache_input;            /* the input is a file worth keeping */
+    transform_input *input;     /* where the document came from */
+    xmlDocPtr doc;              /* cached document, when there is one */
+    int reusable;               /* the transform left the document alone */
+    char *pending;              /* input not parsed yet */
+    apr_size_t npending;
+}
+transform_filter_ctx;
+
+/**
+ * Load the stylesheets to apply to doc: the one the request or the
+ * configuration names, or else the one doc points at, followed by the
+ * rest of a TransformSet pipeline.  Returns NULL if any of them fails.
+ */
+static apr_array_header_t *select_stages(ap_filter_t * f, xmlDocPtr doc)
+{
     xsltStylesheetPtr transform = NULL;
-    xmlDocPtr result = NULL;
+    transform_xslt_entry *entry = NULL;
+    const char *href;
     xmlNodePtr pi_node;
-    xmlOutputBufferPtr output;
-    xmlParserInputBufferCreateFilenameFunc orig;
-    xsltTransformContextPtr tcontext;
-    
+    apr_array_header_t *pipeline = NULL;
+    apr_array_header_t *stages;
+    transform_stage *stage;
+
     transform_notes *notes =
         ap_get_module_config(f->r->request_config, &transform_module);
     dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
@@ -151,38 +322,29 @@ static apr_status_t transform_run(ap_filter_t * f, xmlDocPtr doc)
     svr_cfg *sconf = ap_get_module_config(f->r->server->module_config,
                                           &transform_module);
 
-    if (!doc) {
-        return pass_failure(f, "XSLT: Couldn't parse XML Document", notes);
-    }
-
-    orig = xmlParserInputBufferCreateFilenameDefault(transform_get_input);
-
-    if (dconf->opts & XINCLUDES) {
-        xmlXIncludeProcessFlags(doc,
-                                XML_PARSE_RECOVER | XML_PARSE_XINCLUDE |
-                                XML_PARSE_NONET |  XSLT_PARSE_OPTIONS);
-    }
-
     if (ap_is_initial_req(f->r) && notes->xslt) {
-        if (transform = transform_cache_get(sconf, notes->xslt), transform) {
-            stylesheet_is_cached = 1;
+        if (entry = transform_cache_get(sconf, notes->xslt), entry) {
+            transform = entry->transform;
         }
         else {
-            transform = xsltParseStylesheetFile(notes->xslt);
+            transform = load_stylesheet(f, notes->xslt, &entry);
         }
+        if (dconf->xslt && !strcmp(notes->xslt, dconf->xslt))
+            pipeline = dconf->stages;
     }
     else if(dconf->xslt != NULL) {
-        if(transform = transform_cache_get(sconf, dconf->xslt), transform) {
-            stylesheet_is_cached = 1;
+        if(entry = transform_cache_get(sconf, dconf->xslt), entry) {
+            transform = entry->transform;
         }
         else {
-            transform = xsltParseStylesheetFile(dconf->xslt);
+            transform = load_stylesheet(f, dconf->xslt, &entry);
         }
+        pipeline = dconf->stages;
     }
     else {
         pi_node = find_stylesheet_node(doc);
         if(pi_node == NULL && dconf->default_xslt != NULL){
-            transform = xsltParseStylesheetFile(dconf->default_xslt);
+            transform = load_stylesheet(f, dconf->default_xslt, &entry);
         }
         else if(pi_node == NULL) {
             /* no node was found, plus no default. */
@@ -190,50 +352,30 @@ static apr_status_t transform_run(ap_filter_t * f, xmlDocPtr doc)
                           "mod_transform: XSL not named in XML and No Default XSLT set");
             transform = NULL;
         }
+        else if ((href = find_stylesheet_href(f->r->pool, pi_node))
+                 && transform_cache_resolve(f, href)) {
+            transform = load_stylesheet(f, href, &entry);
+        }
         else {
             transform = xsltLoadStylesheetPI(doc);        
         }
     }
 
-    if (!transform) {
-        xmlParserInputBufferCreateFilenameDefault(orig);
-        return pass_failure(f, "XSLT: Loading of the XSLT File has failed", notes);
-    }
-
-    /* mod_transform plugin hook into transform_run: "begin" */
-    {
-        transform_plugin_info_t *pluginInfo;
-
-        for (pluginInfo = sconf->plugins; pluginInfo != NULL; pluginInfo = pluginInfo->next)
-        {
-            if (pluginInfo->plugin->transform_run_begin != NULL)
-                (*pluginInfo->plugin->transform_run_begin)(f);
-        }
-    }
-
-    // create a new transform context
-    tcontext = xsltNewTransformContext (transform, doc);
-    // Allow XPath functions to have access to request_rec
-    tcontext->xpathCtxt->userData = (void *)f->r;
+    if (!transform)
+        return NULL;
 
-    /*if (dconf->opts & GETVARS) {
-    	getvars = parse_querystring(f->r);
-    } else {
-    	getvars = NULL;
-    }*/
-
-    result = xsltApplyStylesheetUser(transform, doc, NULL, NULL, NULL, tcontext);
-    // free the transform context
-	xsltFreeTransformContext(tcontext);
-
-    if (!result) {
-        if (!stylesheet_is_cached) {
-            xsltFreeStylesheet(transform);
-        }
-        xmlParserInputBufferCreateFilenameDefault(orig);
-        return pass_failure(f, "XSLT: Apply Stylesheet has Failed.", notes);
-    }
+    stages = apr_array_make(f->r->pool, 1, sizeof(transform_stage));
+    stage = apr_array_push(stages);
+    stage->transform = transform;
+    stage->entry = entry;
+    if (!load_stages(f, pipeline, stages))
+        return NULL;
+    return stages;
+}
 
+static void set_content_type(ap_filter_t * f, xsltStylesheetPtr transform,
+                             xmlDocPtr doc)
+{
     if (transform->mediaType) {
         /**
          * Note: If the XSLT We are using doesn't have an encoding, 
@@ -266,41 +408,594 @@ static apr_status_t transform_run(ap_filter_t * f, xmlDocPtr doc)
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r,
                       "mod_transform: Warning, no content type was set! Fix your XSLT!");
     }
+}
+
+/* mod_transform plugin hook into transform_run: "begin" or "done" */
+static void run_plugins(ap_filter_t * f, int done)
+{
+    svr_cfg *sconf = ap_get_module_config(f->r->server->module_config,
+                                          &transform_module);
+    transform_plugin_info_t *pluginInfo;
+
+    for (pluginInfo = sconf->plugins; pluginInfo != NULL; pluginInfo = pluginInfo->next)
+    {
+        if (!done && pluginInfo->plugin->transform_run_begin != NULL)
+            (*pluginInfo->plugin->transform_run_begin)(f);
+        else if (done && pluginInfo->plugin->transform_run_end != NULL)
+            (*pluginInfo->plugin->transform_run_end)(f);
+    }
+}
+
+/* End a response that has no body */
+static apr_status_t pass_eos(ap_filter_t * f)
+{
+    apr_bucket_brigade *bb = apr_brigade_create(f->r->pool,
+                                                f->c->bucket_alloc);
+
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+    return ap_pass_brigade(f->next, bb);
+}
+
+/**
+ * Each stage transforms the result of the one before, in memory.  Sets
+ * *reusable to whether doc itself came through unchanged.
+ */
+static xmlDocPtr apply_stages(ap_filter_t * f, apr_array_header_t *stages,
+                              xmlDocPtr doc, int *reusable)
+{
+    xsltTransformContextPtr tcontext;
+    apr_array_header_t *attached;
+    transform_stage *stage;
+    xmlDocPtr result = NULL;
+    xmlDocPtr input = doc;
+    int i;
+
+    for (i = 0; i < stages->nelts; i++) {
+        stage = &APR_ARRAY_IDX(stages, i, transform_stage);
+        // create a new transform context
+        tcontext = xsltNewTransformContext(stage->transform, input);
+        // Allow XPath functions to have access to request_rec
+        tcontext->xpathCtxt->userData = (void *)f->r;
+        /* Stripping whitespace changes the source document for good */
+        if (input == doc)
+            *reusable = !xsltNeedElemSpaceHandling(tcontext);
+        /* Documents this stylesheet already indexed, with their keys */
+        attached = transform_input_attach(f->r, tcontext, stage->entry);
+
+        result = xsltApplyStylesheetUser(stage->transform, input, NULL, NULL,
+                                         NULL, tcontext);
+        // free the transform context
+        transform_input_finish(f->r, tcontext, stage->entry, attached,
+                               result != NULL);
+        if (input != doc)
+            xmlFreeDoc(input);
+        if (!result)
+            break;
+        input = result;
+    }
+
+    if (!result)
+        *reusable = 0;
+    return result;
+}
+
+static apr_status_t transform_run(ap_filter_t * f, xmlDocPtr doc)
+{
+    size_t length;
+    transform_xmlio_output_ctx output_ctx;
+    xsltStylesheetPtr transform;
+    xmlDocPtr result;
+    xmlOutputBufferPtr output;
+    xmlParserInputBufferCreateFilenameFunc orig;
+    apr_array_header_t *stages;
+    transform_stage *stage;
+    int written;
+    
+    transform_notes *notes =
+        ap_get_module_config(f->r->request_config, &transform_module);
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
+    transform_filter_ctx *fctx = f->ctx;
+    apr_array_header_t *deps = NULL;
+
+    if (!doc) {
+        return pass_failure(f, "XSLT: Couldn't parse XML Document", notes);
+    }
+
+    orig = xmlParserInputBufferCreateFilenameDefault(transform_get_input);
+
+    /* A cached document had its XIncludes processed already */
+    if (!fctx->input)
+        transform_input_include(f, doc, fctx->cache_input, &fctx->input);
+
+    if (!(stages = select_stages(f, doc))) {
+        xmlParserInputBufferCreateFilenameDefault(orig);
+        return pass_failure(f, "XSLT: Loading of the XSLT File has failed", notes);
+    }
+    /* The last stage decides what the output looks like */
+    stage = &APR_ARRAY_IDX(stages, stages->nelts - 1, transform_stage);
+    transform = stage->transform;
+    set_content_type(f, transform, doc);
+
+    /**
+     * A HEAD request gets the headers without running the transform only
+     * when transform_output_conditional already knew the validators and
+     * what the response reads of the request from an earlier GET.  Vary
+     * and Cache-Control come from running it otherwise.
+     */
+    if (f->r->header_only && fctx->validate
+        && apr_table_get(f->r->headers_out, "ETag")) {
+        unload_stages(stages);
+        xmlParserInputBufferCreateFilenameDefault(orig);
+        transform_output_vary(f->r);
+        return pass_eos(f);
+    }
+
+    run_plugins(f, 0);
+
+    /*if (dconf->opts & GETVARS) {
+    	getvars = parse_querystring(f->r);
+    } else {
+    	getvars = NULL;
+    }*/
+
+    if (!(result = apply_stages(f, stages, doc, &fctx->reusable))) {
+        unload_stages(stages);
+        xmlParserInputBufferCreateFilenameDefault(orig);
+        return pass_failure(f, "XSLT: Apply Stylesheet has Failed.", notes);
+    }
+
+    /* Everything the result was made from has been read by now */
+    transform_output_vary(f->r);
+    if (fctx->validate && (deps = transform_output_deps(f->r, stages))) {
+        transform_output_validators(f->r, deps);
+        /* Nothing knew them before, so the preconditions wait until now */
+        if (transform_output_preconditions(f) == OK) {
+            xmlFreeDoc(result);
+            unload_stages(stages);
+            xmlParserInputBufferCreateFilenameDefault(orig);
+            run_plugins(f, 1);
+            return APR_SUCCESS;
+        }
+    }
+
+    /* Transformed only to find out the validators */
+    if (f->r->header_only) {
+        xmlFreeDoc(result);
+        unload_stages(stages);
+        xmlParserInputBufferCreateFilenameDefault(orig);
+        run_plugins(f, 1);
+        return pass_eos(f);
+    }
 
     output_ctx.next = f->next;
-    output_ctx.bb = apr_brigade_create(f->r->pool,
-                                       apr_bucket_alloc_create(f->r->pool));
+    output_ctx.bb = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+    output_ctx.spool = fctx->spool;
+    output_ctx.pending = 0;
+    output_ctx.passed = 0;
+    output_ctx.buf = NULL;
+    output_ctx.used = output_ctx.size = 0;
+    output_ctx.hint = stage->entry ? stage->entry->output_size : 0;
     output =
         xmlOutputBufferCreateIO(&transform_xmlio_output_write,
                                 &transform_xmlio_output_close, &output_ctx,
                                 0);
-    length = xsltSaveResultTo(output, result, transform);
-    if (!f->r->chunked)
+    if (!(dconf->opts & NATIVE_OUTPUT)
+        || !transform_serialize(output, result, transform, &written))
+        written = xsltSaveResultTo(output, result, transform);
+    length = written;
+    /* Headers went out with the first part of a long response */
+    if (!f->r->chunked && !output_ctx.passed)
         ap_set_content_length(f->r, length);
+    if (stage->entry && length != (size_t) -1)
+        stage->entry->output_size = stage->entry->output_size
+            ? (stage->entry->output_size * 3 + (apr_uint32_t) length) / 4
+            : (apr_uint32_t) length;
 
     xmlOutputBufferClose(output);
     xmlFreeDoc(result);
-    if (!stylesheet_is_cached)
-        xsltFreeStylesheet(transform);
+    if (fctx->spool && length != (size_t) -1)
+        transform_spool_commit(f->r, fctx->spool, deps);
+    unload_stages(stages);
 
     xmlParserInputBufferCreateFilenameDefault(orig);
 
     ap_pass_brigade(output_ctx.next, output_ctx.bb);
 
-    /* mod_transform plugin hook into transform_run: "done" */
-    {
-        transform_plugin_info_t *pluginInfo;
+    if (fctx->spool)
+        transform_spool_compress(f->r, fctx->spool);
 
-        for (pluginInfo = sconf->plugins; pluginInfo != NULL; pluginInfo = pluginInfo->next)
-        {
-            if (pluginInfo->plugin->transform_run_end != NULL)
-                (*pluginInfo->plugin->transform_run_end)(f);
+    run_plugins(f, 1);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t free_document(void *doc)
+{
+    xmlFreeDoc(doc);
+    return APR_SUCCESS;
+}
+
+/* Transform the document a handler built instead of anything it sent */
+static apr_status_t transform_handler_document(ap_filter_t * f,
+                                               transform_notes * notes)
+{
+    xmlDocPtr doc = notes->document;
+    apr_status_t ret;
+
+    ret = transform_run(f, doc);
+    /* The transform may have changed it, so nobody else gets to see it */
+    notes->document = NULL;
+    apr_pool_cleanup_run(f->r->pool, doc, free_document);
+    return ret;
+}
+
+/**
+ * Choose the stylesheets from what the parser has seen of the document,
+ * which is where an xml-stylesheet PI would be, and start the response.
+ */
+static int stream_begin(transform_stream * stream, xmlDocPtr doc)
+{
+    ap_filter_t *f = stream->f;
+    transform_notes *notes =
+        ap_get_module_config(f->r->request_config, &transform_module);
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
+
+    stream->begun = 1;
+    if (!(stream->stages = select_stages(f, doc))) {
+        stream->status = pass_failure(f, "XSLT: Loading of the XSLT File has failed", notes);
+        return 0;
+    }
+    stream->transform = APR_ARRAY_IDX(stream->stages,
+                                      stream->stages->nelts - 1,
+                                      transform_stage).transform;
+    set_content_type(f, stream->transform, doc);
+
+    run_plugins(f, 0);
+    /* A HEAD request only reads as far as the headers need */
+    if (f->r->header_only)
+        return 1;
+
+    stream->output_ctx.next = f->next;
+    stream->output_ctx.bb = apr_brigade_create(f->r->pool,
+                                               f->c->bucket_alloc);
+    stream->output =
+        xmlOutputBufferCreateIO(&transform_xmlio_output_write,
+                                &transform_xmlio_output_close,
+                                &stream->output_ctx, 0);
+    if (dconf->stream_wrapper) {
+        xmlOutputBufferWriteString(stream->output, "<");
+        xmlOutputBufferWriteString(stream->output, dconf->stream_wrapper);
+        xmlOutputBufferWriteString(stream->output, ">\n");
+    }
+    return 1;
+}
+
+/**
+ * Write out what a record turned into, as xsltSaveResultTo would but for
+ * the xml declaration and doctype, which would otherwise come once per
+ * record.  Returns -1 once the client has gone.
+ */
+static int stream_write(transform_stream * stream, xmlDocPtr result)
+{
+    xsltStylesheetPtr style = stream->transform;
+    xmlOutputBufferPtr out = stream->output;
+    const xmlChar *method;
+    const xmlChar *encoding;
+    xmlNodePtr child;
+    int indent;
+
+    XSLT_GET_IMPORT_PTR(method, style, method);
+    XSLT_GET_IMPORT_PTR(encoding, style, encoding);
+    XSLT_GET_IMPORT_INT(indent, style, indent);
+
+    if (method && xmlStrEqual(method, BAD_CAST "text"))
+        return xsltSaveResultTo(out, result, style) < 0 ? -1 : 0;
+    for (child = result->children; child; child = child->next) {
+        if (child->type == XML_DTD_NODE)
+            continue;
+        if (result->type == XML_HTML_DOCUMENT_NODE)
+            htmlNodeDumpFormatOutput(out, result, child,
+                                     (const char *) encoding, indent != 0);
+        else
+            xmlNodeDumpOutput(out, result, child, 0, indent == 1,
+                              (const char *) encoding);
+    }
+    if (indent && result->children)
+        xmlOutputBufferWriteString(out, "\n");
+    return out->error ? -1 : 0;
+}
+
+/* The parser has all of a record: transform it and let it go */
+static void stream_record(xmlParserCtxtPtr ctxt, transform_stream * stream,
+                          xmlNodePtr node)
+{
+    ap_filter_t *f = stream->f;
+    transform_notes *notes =
+        ap_get_module_config(f->r->request_config, &transform_module);
+    xmlParserInputBufferCreateFilenameFunc orig;
+    xmlNodePtr parent = node->parent;
+    xmlNodePtr ancestor;
+    xmlNodePtr open = NULL;
+    xmlNodePtr child;
+    xmlDocPtr doc;
+    xmlDocPtr result;
+    int reusable;
+
+    orig = xmlParserInputBufferCreateFilenameDefault(transform_get_input);
+
+    /* xmlSAX2EndDocument won't have set it yet */
+    if (!ctxt->myDoc->encoding && ctxt->encoding)
+        ctxt->myDoc->encoding = xmlStrdup(ctxt->encoding);
+    if (!stream->begun && !stream_begin(stream, ctxt->myDoc)) {
+        xmlParserInputBufferCreateFilenameDefault(orig);
+        stream->done = 1;
+        xmlStopParser(ctxt);
+        return;
+    }
+
+    /* The record becomes a document of its own, sharing the parser's names */
+    xmlUnlinkNode(node);
+    doc = xmlNewDoc(BAD_CAST "1.0");
+    if ((doc->dict = ctxt->myDoc->dict))
+        xmlDictReference(doc->dict);
+    xmlDocSetRootElement(doc, node);
+    /* Namespaces declared further up are declared on the record instead */
+    xmlReconciliateNs(doc, node);
+
+    /**
+     * Nor is anything that came before it needed now, in its parent or
+     * further up, where the last child is the element still open.
+     */
+    for (ancestor = parent; ancestor && ancestor->type == XML_ELEMENT_NODE;
+         open = ancestor, ancestor = ancestor->parent) {
+        while ((child = ancestor->children) && child != open) {
+            xmlUnlinkNode(child);
+            xmlFreeNode(child);
         }
     }
 
-    return APR_SUCCESS;
+    transform_input_include(f, doc, 0, NULL);
+    result = apply_stages(f, stream->stages, doc, &reusable);
+    xmlFreeDoc(doc);
+    xmlParserInputBufferCreateFilenameDefault(orig);
+
+    if (!result) {
+        stream->status = pass_failure(f, "XSLT: Apply Stylesheet has Failed.", notes);
+        stream->done = 1;
+        xmlStopParser(ctxt);
+        return;
+    }
+    /**
+     * The headers go out before the later records are read, so they can
+     * only say what the first one read.  That is all a HEAD request reads.
+     */
+    if (!stream->records++) {
+        transform_output_vary(f->r);
+        if (f->r->header_only) {
+            xmlFreeDoc(result);
+            stream->done = 1;
+            xmlStopParser(ctxt);
+            return;
+        }
+    }
+    if (stream_write(stream, result) < 0) {
+        stream->done = 1;
+        xmlStopParser(ctxt);
+    }
+    xmlFreeDoc(result);
+}
+
+static void stream_start(void *ctx, const xmlChar * localname,
+                         const xmlChar * prefix, const xmlChar * URI,
+                         int nb_namespaces, const xmlChar ** namespaces,
+                         int nb_attributes, int nb_defaulted,
+                         const xmlChar ** attributes)
+{
+    xmlParserCtxtPtr ctxt = ctx;
+    transform_stream *stream = ctxt->_private;
+    const char *step;
+
+    xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces,
+                          namespaces, nb_attributes, nb_defaulted,
+                          attributes);
+    if (stream->matched == stream->depth++
+        && stream->depth <= stream->path->nelts) {
+        step = APR_ARRAY_IDX(stream->path, stream->depth - 1, const char *);
+        if (!strcmp(step, "*") || xmlStrEqual(BAD_CAST step, localname))
+            stream->matched = stream->depth;
+    }
+}
+
+static void stream_end(void *ctx, const xmlChar * localname,
+                       const xmlChar * prefix, const xmlChar * URI)
+{
+    xmlParserCtxtPtr ctxt = ctx;
+    transform_stream *stream = ctxt->_private;
+    xmlNodePtr node = ctxt->node;
+    int record = stream->matched == stream->depth
+        && stream->depth == stream->path->nelts;
+
+    xmlSAX2EndElementNs(ctx, localname, prefix, URI);
+    if (stream->matched == stream->depth)
+        stream->matched--;
+    stream->depth--;
+    if (record && node && !stream->done)
+        stream_record(ctxt, stream, node);
+}
+
+static transform_stream *stream_create(ap_filter_t * f, dir_cfg * dconf)
+{
+    transform_stream *stream = apr_pcalloc(f->r->pool,
+                                           sizeof(transform_stream));
+
+    stream->f = f;
+    stream->path = dconf->stream;
+    xmlSAXVersion(&stream->sax, 2);
+    stream->sax.startElementNs = stream_start;
+    stream->sax.endElementNs = stream_end;
+    return stream;
+}
+
+/* At EOS: finish parsing, which may turn up the last records, and close */
+static apr_status_t stream_finish(ap_filter_t * f)
+{
+    transform_filter_ctx *fctx = f->ctx;
+    transform_stream *stream = fctx->stream;
+    xmlParserCtxtPtr ctxt = fctx->ctxt;
+    transform_notes *notes =
+        ap_get_module_config(f->r->request_config, &transform_module);
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
+    xmlParserInputBufferCreateFilenameFunc orig;
+    int written;
+
+    if (ctxt) {
+        if (!stream->done)
+            xmlParseChunk(ctxt, NULL, 0, 1);
+        /* Without any records, the stylesheets come from what there is */
+        if (!stream->begun && ctxt->myDoc) {
+            orig = xmlParserInputBufferCreateFilenameDefault(transform_get_input);
+            stream_begin(stream, ctxt->myDoc);
+            xmlParserInputBufferCreateFilenameDefault(orig);
+        }
+    }
+    if (!stream->begun)
+        stream->status = pass_failure(f, "XSLT: Couldn't parse XML Document", notes);
+    else if (stream->stages && !stream->records)
+        transform_output_vary(f->r);
+
+    if (stream->output) {
+        /* A response cut short by a failure is left unfinished */
+        if (dconf->stream_wrapper && stream->status == APR_SUCCESS) {
+            xmlOutputBufferWriteString(stream->output, "</");
+            xmlOutputBufferWriteString(stream->output, dconf->stream_wrapper);
+            xmlOutputBufferWriteString(stream->output, ">\n");
+        }
+        written = xmlOutputBufferClose(stream->output);
+        stream->output = NULL;
+        if (!f->r->chunked && !stream->output_ctx.passed && written >= 0)
+            ap_set_content_length(f->r, written);
+        ap_pass_brigade(stream->output_ctx.next, stream->output_ctx.bb);
+    }
+    /* A HEAD request */
+    else if (stream->stages && stream->status == APR_SUCCESS) {
+        stream->status = pass_eos(f);
+    }
+    if (stream->stages) {
+        run_plugins(f, 1);
+        unload_stages(stream->stages);
+    }
+    if (ctxt) {
+        xmlFreeDoc(ctxt->myDoc);
+        ctxt->myDoc = NULL;
+        xmlFreeParserCtxt(ctxt);
+        fctx->ctxt = NULL;
+    }
+    return stream->status;
+}
+
+/* Hand input to the push parser, starting it with the first of it */
+static void input_parse(ap_filter_t * f, const char *buf, apr_size_t len)
+{
+    transform_filter_ctx *fctx = f->ctx;
+
+    if (fctx->ctxt) {
+        xmlParseChunk(fctx->ctxt, buf, (int) len, 0);
+    }
+    else {
+        fctx->ctxt = xmlCreatePushParserCtxt(fctx->stream ? &fctx->stream->sax
+                                             : 0, 0, buf, (int) len, 0);
+        fctx->ctxt->_private = fctx->stream;
+        xmlCtxtUseOptions(fctx->ctxt, XML_PARSE_NOENT | XML_PARSE_NOCDATA);
+        fctx->ctxt->directory = xmlParserGetDirectory(f->r->filename);
+    }
+}
+
+/* Parse whatever has been gathered so far */
+static void input_flush(ap_filter_t * f)
+{
+    transform_filter_ctx *fctx = f->ctx;
+
+    if (fctx->npending) {
+        input_parse(f, fctx->pending, fctx->npending);
+        fctx->npending = 0;
+    }
 }
 
+/**
+ * Gather input into chunks of TransformInputChunkSize, so tiny buckets
+ * from a proxy or CGI don't cost a parser call each.  Buckets that big
+ * already are parsed where they are.
+ */
+static void input_feed(ap_filter_t * f, const char *buf, apr_size_t len)
+{
+    transform_filter_ctx *fctx = f->ctx;
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
+    apr_size_t chunk = dconf->input_chunk ? dconf->input_chunk
+        : TRANSFORM_INPUT_CHUNK_DEFAULT;
+    apr_size_t n;
+
+    if (!fctx->npending && len >= chunk) {
+        input_parse(f, buf, len);
+        return;
+    }
+    if (!fctx->pending)
+        fctx->pending = apr_palloc(f->r->pool, chunk);
+    while (len) {
+        n = chunk - fctx->npending < len ? chunk - fctx->npending : len;
+        memcpy(fctx->pending + fctx->npending, buf, n);
+        fctx->npending += n;
+        buf += n;
+        len -= n;
+        if (fctx->npending == chunk)
+            input_flush(f);
+    }
+}
+
+#if APR_HAS_MMAP
+/**
+ * A file sent whole, as one FILE bucket and EOS, is mapped and parsed in
+ * one go rather than read into the push parser a bucket at a time.
+ * Returns 0, having touched nothing, when it can't be.
+ */
+static int parse_mapped(ap_filter_t * f, apr_bucket_brigade * bb,
+                        xmlDocPtr * doc, int *well_formed)
+{
+    apr_bucket *b = APR_BRIGADE_FIRST(bb);
+    apr_bucket_file *file;
+    apr_mmap_t *mm;
+    xmlParserCtxtPtr ctxt;
+
+    if (b == APR_BRIGADE_SENTINEL(bb) || !APR_BUCKET_IS_FILE(b)
+        || APR_BUCKET_NEXT(b) == APR_BRIGADE_SENTINEL(bb)
+        || !APR_BUCKET_IS_EOS(APR_BUCKET_NEXT(b))
+        || !b->length || b->length > INT_MAX)
+        return 0;
+    file = b->data;
+    /* EnableMMAP Off */
+    if (!file->can_mmap
+        || apr_mmap_create(&mm, file->fd, b->start, b->length, APR_MMAP_READ,
+                           f->r->pool) != APR_SUCCESS)
+        return 0;
+    if (!(ctxt = xmlCreateMemoryParserCtxt(mm->mm, (int) b->length))) {
+        apr_mmap_delete(mm);
+        return 0;
+    }
+    xmlCtxtUseOptions(ctxt, XML_PARSE_NOENT | XML_PARSE_NOCDATA);
+    ctxt->directory = xmlParserGetDirectory(f->r->filename);
+    xmlParseDocument(ctxt);
+    *doc = ctxt->myDoc;
+    *well_formed = ctxt->wellFormed;
+    ctxt->myDoc = NULL;
+    xmlFreeParserCtxt(ctxt);
+    apr_mmap_delete(mm);
+    return 1;
+}
+#endif
+
 static apr_status_t transform_filter_init(ap_filter_t * f)
 {
     svr_cfg *sconf = ap_get_module_config(f->r->server->module_config,
@@ -322,47 +1017,123 @@ static apr_status_t transform_filter_init(ap_filter_t * f)
 
 static apr_status_t transform_filter(ap_filter_t * f, apr_bucket_brigade * bb)
 {
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
     apr_bucket *b;
     const char *buf = 0;
     apr_size_t bytes = 0;
-    xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr) f->ctx;
+    transform_filter_ctx *fctx = f->ctx;
+    transform_notes *notes = ap_get_module_config(f->r->request_config,
+                                                  &transform_module);
+    xmlParserCtxtPtr ctxt;
+    xmlDocPtr doc;
+    int well_formed;
+    apr_status_t rv;
     apr_status_t ret = APR_SUCCESS;
     void *orig_error_cb = xmlGenericErrorContext;
     xmlGenericErrorFunc orig_error_func = xmlGenericError;
 
-    xmlSetGenericErrorFunc((void *) f, transform_error_cb);
-
     /* First Run of this Filter */
-    if (!ctxt) {
+    if (!fctx) {
+        f->ctx = fctx = apr_pcalloc(f->r->pool, sizeof(transform_filter_ctx));
         /* unset content-length */
         apr_table_unset(f->r->headers_out, "Content-Length");
         if (f->r->filename) {
             depends_add_file(f->r, f->r->filename);
         }
+        fctx->reusable = 1;
+        /* Records are transformed as they arrive, and nothing is kept */
+        if (dconf->stream && dconf->stream->nelts) {
+            fctx->stream = stream_create(f, dconf);
+        }
+        else {
+            fctx->validate = transform_output_static(f, bb);
+            if (transform_output_conditional(f, bb) == OK
+                || transform_output_lookup(f, bb, &fctx->spool) == OK)
+                fctx->done = 1;
+            else
+                fctx->cache_input = transform_input_lookup(f, bb, &fctx->doc,
+                                                           &fctx->input);
+        }
+    }
+
+    if (fctx->done) {
+        apr_brigade_cleanup(bb);
+        return APR_SUCCESS;
     }
 
+    ctxt = fctx->ctxt;
+    xmlSetGenericErrorFunc((void *) f, transform_error_cb);
+
     if ((f->r->proto_num >= 1001) && !f->r->main && !f->r->prev)
         f->r->chunked = 1;
 
+    if (notes && notes->document) {
+        fctx->done = 1;
+        ret = transform_handler_document(f, notes);
+        apr_brigade_cleanup(bb);
+    }
+    /* The document was cached, so the rest of the file isn't needed */
+    else if (fctx->doc) {
+        fctx->done = 1;
+        ret = transform_run(f, fctx->doc);
+        transform_input_release(fctx->input, fctx->doc, fctx->reusable);
+        fctx->doc = NULL;
+        fctx->input = NULL;
+        apr_brigade_cleanup(bb);
+    }
+#if APR_HAS_MMAP
+    else if (!ctxt && !fctx->npending && !fctx->stream
+             && parse_mapped(f, bb, &doc, &well_formed)) {
+        fctx->done = 1;
+        if (!well_formed)
+            fctx->cache_input = 0;
+        ret = transform_run(f, doc);
+        transform_input_release(fctx->input, doc, fctx->reusable);
+        fctx->input = NULL;
+        apr_brigade_cleanup(bb);
+    }
+#endif
+
     for (b = APR_BRIGADE_FIRST(bb);
          b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
         if (APR_BUCKET_IS_EOS(b)) {
-            if (ctxt) {         /* done reading the file. run the transform now */
+            input_flush(f);
+            ctxt = fctx->ctxt;
+            if (fctx->stream) {
+                ret = stream_finish(f);
+            }
+            else if (ctxt) {    /* done reading the file. run the transform now */
                 xmlParseChunk(ctxt, buf, 0, 1);
+                if (!ctxt->wellFormed)
+                    fctx->cache_input = 0;
                 ret = transform_run(f, ctxt->myDoc);
+                transform_input_release(fctx->input, ctxt->myDoc,
+                                        fctx->reusable);
+                fctx->input = NULL;
+                ctxt->myDoc = NULL;
                 xmlFreeParserCtxt(ctxt);
             }
         }
-        else if (apr_bucket_read(b, &buf, &bytes, APR_BLOCK_READ)
-                 == APR_SUCCESS) {
-            if (ctxt) {
-                xmlParseChunk(ctxt, buf, bytes, 0);
-            }
-            else {
-                f->ctx = ctxt = xmlCreatePushParserCtxt(0, 0, buf, bytes, 0);
-                xmlCtxtUseOptions(ctxt, XML_PARSE_NOENT | XML_PARSE_NOCDATA);
-                ctxt->directory = xmlParserGetDirectory(f->r->filename);
+        else if (APR_BUCKET_IS_FLUSH(b)) {
+            input_flush(f);
+        }
+        /* A failed stream only has its response to finish */
+        else if (fctx->stream && fctx->stream->done) {
+            continue;
+        }
+        else {
+            /**
+             * A pipe or socket with nothing in it yet: parse what has been
+             * gathered while the backend is busy, then wait for it.
+             */
+            rv = apr_bucket_read(b, &buf, &bytes, APR_NONBLOCK_READ);
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                input_flush(f);
+                rv = apr_bucket_read(b, &buf, &bytes, APR_BLOCK_READ);
             }
+            if (rv == APR_SUCCESS)
+                input_feed(f, buf, bytes);
         }
     }
     apr_brigade_destroy(bb);
@@ -379,6 +1150,20 @@ static void *transform_merge_dir_config(apr_pool_t * p, void *basev, void *addv)
     dir_cfg *to = apr_palloc(p, sizeof(dir_cfg));
 
     to->xslt = (merge->xslt != 0) ? merge->xslt : from->xslt;
+    to->stages = (merge->xslt != 0) ? merge->stages : from->stages;
+    to->default_xslt = (merge->default_xslt != 0) ? merge->default_xslt
+        : from->default_xslt;
+    to->output_cache = (merge->output_cache != 0) ? merge->output_cache
+        : from->output_cache;
+    to->output_wait = (merge->output_wait >= 0) ? merge->output_wait
+        : from->output_wait;
+    to->cache_control = (merge->cache_control != 0) ? merge->cache_control
+        : from->cache_control;
+    to->input_chunk = merge->input_chunk ? merge->input_chunk
+        : from->input_chunk;
+    to->stream = merge->stream ? merge->stream : from->stream;
+    to->stream_wrapper = merge->stream ? merge->stream_wrapper
+        : from->stream_wrapper;
 
     /* This code comes from mod_autoindex's IndexOptions */
     if (merge->opts & NO_OPTIONS) {
@@ -432,6 +1217,8 @@ static void *create_server_cfg(apr_pool_t * p, server_rec * x)
     svr_cfg *cfg = apr_pcalloc(p, sizeof(svr_cfg));
     apr_pool_cleanup_register(p, cfg, transform_cache_free, apr_pool_cleanup_null);
     cfg->announce = 1;
+    cfg->reload = 1;
+    cfg->input_max_bytes = TRANSFORM_INPUT_MAX_BYTES_DEFAULT;
     cfg->plugins = NULL;
     return cfg;
 }
@@ -444,13 +1231,129 @@ static void *transform_create_dir_config(apr_pool_t * p, char *x)
     conf->incremented_opts = 0;
     conf->decremented_opts = 0;
     conf->xslt = NULL;
+    conf->output_wait = -1;
     return conf;
 }
 
-static const char *use_xslt(cmd_parms * cmd, void *cfg, const char *xslt)
+static const char *use_xslt(cmd_parms * cmd, void *cfg, const char *args)
+{
+    dir_cfg *conf = (dir_cfg *) cfg;
+    char *xslt;
+
+    conf->xslt = ap_getword_conf(cmd->pool, &args);
+    if (!*conf->xslt)
+        return "TransformSet takes one or more stylesheets";
+    /* The rest are applied in turn to the result of the first */
+    conf->stages = NULL;
+    while (*(xslt = ap_getword_conf(cmd->pool, &args))) {
+        if (!conf->stages)
+            conf->stages = apr_array_make(cmd->pool, 2, sizeof(const char *));
+        APR_ARRAY_PUSH(conf->stages, const char *) = xslt;
+    }
+    return NULL;
+}
+
+static const char *set_output_cache(cmd_parms * cmd, void *cfg,
+                                    const char *dir)
 {
     dir_cfg *conf = (dir_cfg *) cfg;
-    conf->xslt = apr_pstrdup(cmd->pool, xslt);
+    conf->output_cache = ap_server_root_relative(cmd->pool, dir);
+    if (!conf->output_cache)
+        return apr_pstrcat(cmd->pool, "Invalid TransformOutputCache path ",
+                           dir, NULL);
+    return NULL;
+}
+
+static const char *set_output_wait(cmd_parms * cmd, void *cfg,
+                                   const char *arg)
+{
+    dir_cfg *conf = (dir_cfg *) cfg;
+    char *end;
+    double secs = strtod(arg, &end);
+
+    if (*end || secs < 0)
+        return "TransformOutputCacheWait must be a number of seconds";
+    conf->output_wait = (apr_interval_time_t) (secs * APR_USEC_PER_SEC);
+    return NULL;
+}
+
+/**
+ * The handler runs after this, and would answer conditional requests
+ * using validators of the input alone; keep them for the XSLT filter.
+ */
+static void transform_insert_filter(request_rec * r)
+{
+    ap_filter_t *f;
+
+    for (f = r->output_filters; f; f = f->next) {
+        if (!strcasecmp(f->frec->name, XSLT_FILTER_NAME)) {
+            transform_output_hide_conditionals(r);
+            break;
+        }
+    }
+}
+
+/**
+ * SetHandler transform-xslt sends the file to the XSLT filter, added if
+ * it isn't there, as it is: one FILE bucket and EOS, which the filter
+ * maps and parses directly.
+ */
+static int transform_file_handler(request_rec * r)
+{
+    core_dir_config *core = ap_get_module_config(r->per_dir_config,
+                                                 &core_module);
+    ap_filter_t *f;
+    apr_file_t *fd;
+    apr_bucket_brigade *bb;
+    apr_bucket *b;
+    apr_status_t rv;
+
+    if (!r->handler || strcmp(r->handler, TRANSFORM_FILE_HANDLER))
+        return DECLINED;
+
+    r->allowed |= (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET)
+        return HTTP_METHOD_NOT_ALLOWED;
+    if (r->finfo.filetype != APR_REG || (r->path_info && *r->path_info)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "mod_transform: File does not exist: %s", r->filename);
+        return HTTP_NOT_FOUND;
+    }
+    if ((rv = apr_file_open(&fd, r->filename, APR_READ | APR_BINARY, 0,
+                            r->pool)) != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r,
+                      "mod_transform: file permissions deny server access: %s",
+                      r->filename);
+        return HTTP_FORBIDDEN;
+    }
+
+    for (f = r->output_filters; f; f = f->next) {
+        if (!strcasecmp(f->frec->name, XSLT_FILTER_NAME))
+            break;
+    }
+    if (!f)
+        ap_add_output_filter(XSLT_FILTER_NAME, NULL, r, r->connection);
+
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    b = apr_bucket_file_create(fd, 0, (apr_size_t) r->finfo.size, r->pool,
+                               bb->bucket_alloc);
+#if APR_HAS_MMAP
+    /* As default_handler does; parse_mapped goes by the bucket */
+    if (core->enable_mmap == ENABLE_MMAP_OFF)
+        (void) apr_bucket_file_enable_mmap(b, 0);
+#endif
+    APR_BRIGADE_INSERT_TAIL(bb, b);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+    rv = ap_pass_brigade(r->output_filters, bb);
+    return rv == APR_SUCCESS || r->connection->aborted ? OK
+        : HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static const char *set_cache_control(cmd_parms * cmd, void *cfg,
+                                     const char *value)
+{
+    dir_cfg *conf = (dir_cfg *) cfg;
+    conf->cache_control = strcasecmp(value, "Off") ? value : "";
     return NULL;
 }
 
@@ -496,6 +1399,15 @@ static const char *add_opts(cmd_parms * cmd, void *d, const char *optstr)
         else if (!strcasecmp(w, "XIncludes")) {
             option = XINCLUDES;
         }
+        else if (!strcasecmp(w, "CacheInput")) {
+            option = CACHE_INPUT;
+        }
+        else if (!strcasecmp(w, "CacheDocuments")) {
+            option = CACHE_DOCUMENTS;
+        }
+        else if (!strcasecmp(w, "NativeOutput")) {
+            option = NATIVE_OUTPUT;
+        }
         else if (!strcasecmp(w, "None")) {
             if (action != '\0') {
                 return "Cannot combine '+' or '-' with 'None' keyword";
@@ -539,6 +1451,13 @@ static void transform_child_init(apr_pool_t *p, server_rec *s)
     xmlInitParser();
     xmlInitThreads();
 
+    transform_cache_child_init(p, s);
+    transform_output_child_init(p, s);
+    transform_fragment_child_init(p, s);
+    transform_input_child_init(p, s);
+    transform_io_child_init(p, s);
+    transform_serialize_child_init(p, s);
+
     /* register EXSLT functions */
     exsltRegisterAll();
 
@@ -575,6 +1494,85 @@ static const char *set_announce(cmd_parms *cmd,
     return NULL;
 }
 
+static const char *set_reload(cmd_parms *cmd, void *struct_ptr, int arg)
+{
+    svr_cfg *cfg = ap_get_module_config(cmd->server->module_config,
+                                        &transform_module);
+
+    cfg->reload = arg ? 1 : 0;
+    return NULL;
+}
+
+static const char *set_cache_max_bytes(cmd_parms *cmd, void *struct_ptr,
+                                       const char *arg)
+{
+    svr_cfg *cfg = ap_get_module_config(cmd->server->module_config,
+                                        &transform_module);
+    char *end;
+
+    if (apr_strtoff(&cfg->cache_max_bytes, arg, &end, 10) != APR_SUCCESS
+        || *end || cfg->cache_max_bytes < 0) {
+        return "TransformCacheMaxBytes must be a number of bytes";
+    }
+    return NULL;
+}
+
+static const char *set_input_max_bytes(cmd_parms *cmd, void *struct_ptr,
+                                       const char *arg)
+{
+    svr_cfg *cfg = ap_get_module_config(cmd->server->module_config,
+                                        &transform_module);
+    char *end;
+
+    if (apr_strtoff(&cfg->input_max_bytes, arg, &end, 10) != APR_SUCCESS
+        || *end || cfg->input_max_bytes < 0) {
+        return "TransformInputCacheMaxBytes must be a number of bytes";
+    }
+    return NULL;
+}
+
+static const char *set_input_chunk(cmd_parms *cmd, void *cfg,
+                                   const char *arg)
+{
+    dir_cfg *conf = (dir_cfg *) cfg;
+    apr_off_t size;
+    char *end;
+
+    if (apr_strtoff(&size, arg, &end, 10) != APR_SUCCESS || *end
+        || size < 1 || size > INT_MAX) {
+        return "TransformInputChunkSize must be a number of bytes";
+    }
+    conf->input_chunk = (apr_size_t) size;
+    return NULL;
+}
+
+static const char *set_stream(cmd_parms *cmd, void *cfg, const char *path,
+                              const char *wrapper)
+{
+    dir_cfg *conf = (dir_cfg *) cfg;
+    char *steps;
+    char *step;
+    char *last;
+
+    conf->stream = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    conf->stream_wrapper = NULL;
+    if (!strcasecmp(path, "Off") && !wrapper)
+        return NULL;
+    if (path[0] != '/' || path[1] == '\0')
+        return "TransformStream takes an element path such as /export/record, or Off";
+    steps = apr_pstrdup(cmd->pool, path);
+    for (step = apr_strtok(steps, "/", &last); step;
+         step = apr_strtok(NULL, "/", &last))
+        APR_ARRAY_PUSH(conf->stream, const char *) = step;
+    if (wrapper) {
+        if (xmlValidateName((const xmlChar *) wrapper, 0))
+            return apr_pstrcat(cmd->pool, "TransformStream: ", wrapper,
+                               " is not an element name", NULL);
+        conf->stream_wrapper = wrapper;
+    }
+    return NULL;
+}
+
 static const char **build_args(apr_pool_t *pool, const char *line, int *argc) {
     char *args[512];
     char *word;
@@ -661,6 +1659,18 @@ static int transform_post_config(apr_pool_t *p, apr_pool_t *log, apr_pool_t *pte
 {
     svr_cfg *cfg = ap_get_module_config(s->module_config,
 					&transform_module);
+    server_rec *vhost;
+
+    /* Compile every TransformCache stylesheet, then index them per server */
+    if (transform_cache_compile(p, ptemp, s) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, 0, s,
+                     "mod_transform: Error trying to precompile XSLT");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    for (vhost = s; vhost; vhost = vhost->next) {
+        transform_cache_index(p, ap_get_module_config(vhost->module_config,
+                                                      &transform_module));
+    }
 
     /* Add version string to Apache headers */
     if (cfg->announce) {
@@ -705,6 +1715,12 @@ static void transform_hooks(apr_pool_t * p)
 
     ap_hook_post_read_request(init_notes, NULL, NULL, APR_HOOK_MIDDLE);
 
+    ap_hook_insert_filter(transform_insert_filter, NULL, NULL, APR_HOOK_LAST);
+
+    ap_hook_handler(transform_cache_status, NULL, NULL, APR_HOOK_MIDDLE);
+
+    ap_hook_handler(transform_file_handler, NULL, NULL, APR_HOOK_MIDDLE);
+
     ap_register_output_filter(XSLT_FILTER_NAME, transform_filter, transform_filter_init,
                               AP_FTYPE_RESOURCE);
     ap_register_output_filter(APACHEFS_FILTER_NAME, transform_apachefs_filter, NULL,
@@ -714,12 +1730,36 @@ static void transform_hooks(apr_pool_t * p)
 
 static const command_rec transform_cmds[] = {
 
-    AP_INIT_TAKE1("TransformSet", use_xslt, NULL, OR_ALL,
-                  "Stylesheet to use"),
+    AP_INIT_RAW_ARGS("TransformSet", use_xslt, NULL, OR_ALL,
+                     "Stylesheet to use, or stylesheets to apply in turn"),
 
     AP_INIT_TAKE2("TransformCache", transform_cache_add, NULL, RSRC_CONF,
                   "URL and Path for stylesheet to preload"),
 
+    AP_INIT_TAKE1("TransformCacheMaxBytes", set_cache_max_bytes, NULL, RSRC_CONF,
+                  "Memory limit for stylesheets compiled at runtime; global in the main server, per virtual host otherwise. Default: 0 (unlimited)"),
+
+    AP_INIT_FLAG("TransformCacheReload", set_reload, NULL, RSRC_CONF,
+                 "Whether to recompile TransformCache stylesheets when they change on disk. Default: On"),
+
+    AP_INIT_TAKE1("TransformInputCacheMaxBytes", set_input_max_bytes, NULL, RSRC_CONF,
+                  "Memory limit of each child for documents kept by TransformOptions CacheInput and CacheDocuments; only read in the main server. Default: 33554432, 0 for unlimited"),
+
+    AP_INIT_TAKE1("TransformInputChunkSize", set_input_chunk, NULL, OR_ALL,
+                  "Bytes of input to gather before parsing them. Default: 32768"),
+
+    AP_INIT_TAKE12("TransformStream", set_stream, NULL, OR_ALL,
+                   "Path of the repeating element to transform one at a time, and an element to wrap the results in, or Off"),
+
+    AP_INIT_TAKE1("TransformOutputCache", set_output_cache, NULL, RSRC_CONF | ACCESS_CONF,
+                  "Directory to keep transformed static files in, shared by all children"),
+
+    AP_INIT_TAKE1("TransformOutputCacheWait", set_output_wait, NULL, RSRC_CONF | ACCESS_CONF,
+                  "Seconds to wait for another request producing the same output before transforming again. Default: 10"),
+
+    AP_INIT_TAKE1("TransformCacheControl", set_cache_control, NULL, OR_ALL,
+                  "Cache-Control header for responses made from files only, or Off. Default: public, max-age=0"),
+
     AP_INIT_RAW_ARGS("TransformOptions", add_opts, NULL, OR_INDEXES,
                      "one or more index options [+|-][]"),
 
@@ -755,7 +1795,54 @@ void mod_transform_XSLTDoc(request_rec * r, xmlDocPtr doc)
 {
     transform_notes *notes = ap_get_module_config(r->request_config,
                                                &transform_module);
+    if (notes->document == doc)
+        return;
+    /* The request owns the document from now on */
+    if (notes->document)
+        apr_pool_cleanup_run(r->pool, notes->document, free_document);
     notes->document = doc;
+    if (doc)
+        apr_pool_cleanup_register(r->pool, doc, free_document,
+                                  apr_pool_cleanup_null);
+}
+
+static void add_use(request_rec * r, char kind, const char *name)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                               &transform_module);
+    int i;
+
+    if (!notes || !name)
+        return;
+    if (!notes->uses)
+        notes->uses = apr_array_make(r->pool, 4, sizeof(const char *));
+    for (i = 0; i < notes->uses->nelts; i++) {
+        const char *use = APR_ARRAY_IDX(notes->uses, i, const char *);
+        /* Header names are case insensitive, argument names aren't */
+        if (*use == kind && (kind == 'H' ? !strcasecmp(use + 1, name)
+                             : !strcmp(use + 1, name)))
+            return;
+    }
+    APR_ARRAY_PUSH(notes->uses, const char *) =
+        apr_psprintf(r->pool, "%c%s", kind, name);
+}
+
+void mod_transform_used_header(request_rec * r, const char *name)
+{
+    add_use(r, 'H', name);
+}
+
+void mod_transform_used_arg(request_rec * r, const char *name)
+{
+    add_use(r, 'A', name);
+}
+
+void mod_transform_uncacheable(request_rec * r)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                               &transform_module);
+    if (notes)
+        notes->uncacheable = 1;
 }
 
 /* vim:ai:et:ts=4:nowrap
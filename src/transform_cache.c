@@ -24,53 +24,1404 @@
 
 #include "mod_transform_private.h"
 
-void *transform_cache_get(svr_cfg * sconf, const char *descriptor)
+#include "apr_thread_proc.h"
+#include "apr_lib.h"
+#include <libxslt/extensions.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+/* Compiled stylesheet entries
+ *
+ * Every compiled stylesheet lives in a transform_xslt_entry with its own
+ * pool and an atomic reference count.  Whoever holds the entry (the
+ * TransformCache slot or the runtime cache) owns one reference, and each
+ * request using it owns another, so an entry that gets replaced is freed
+ * by whichever side lets go last.
+ */
+static void add_dep(apr_array_header_t *deps, xmlDocPtr doc)
 {
-    transform_xslt_cache *p;
-    if (!descriptor)
+    transform_xslt_dep *dep;
+
+    if (!doc || !doc->URL)
+        return;
+    dep = apr_array_push(deps);
+    dep->path = apr_pstrdup(deps->pool, (const char *) doc->URL);
+    if (!strncmp(dep->path, "file://", 7))
+        dep->path += 7;
+}
+
+static void collect_deps(apr_array_header_t *deps, xsltStylesheetPtr style)
+{
+    xsltDocumentPtr include;
+    xsltStylesheetPtr import;
+
+    add_dep(deps, style->doc);
+    for (include = style->docList; include; include = include->next)
+        add_dep(deps, include->doc);
+    for (import = style->imports; import; import = import->next)
+        collect_deps(deps, import);
+}
+
+/* Record (check == 0) or verify (check != 0) the identity of every dep */
+static int stat_deps(apr_array_header_t *deps, int check, apr_pool_t *p)
+{
+    int i;
+    apr_finfo_t finfo;
+    transform_xslt_dep *dep = (transform_xslt_dep *) deps->elts;
+
+    for (i = 0; i < deps->nelts; i++, dep++) {
+        if (apr_stat(&finfo, dep->path,
+                     APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE,
+                     p) != APR_SUCCESS)
+            return 0;
+        if (!check) {
+            dep->mtime = finfo.mtime;
+            dep->inode = finfo.inode;
+            dep->size = finfo.size;
+        }
+        else if (dep->mtime != finfo.mtime || dep->inode != finfo.inode
+                 || dep->size != finfo.size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Estimate of the memory held by a compiled stylesheet: its parsed
+ * documents, templates, precompiled instructions and the strings in its
+ * dictionary.  libxslt has no way to tell, so this walks the structures
+ * and adds up what they are known to allocate.
+ */
+static apr_size_t node_size(xmlDictPtr dict, xmlNodePtr node)
+{
+    apr_size_t size = 0;
+
+    for (; node; node = node->next) {
+        size += sizeof(xmlNode);
+        if (node->content && !(dict && xmlDictOwns(dict, node->content)))
+            size += xmlStrlen(node->content) + 1;
+        if (node->type == XML_ELEMENT_NODE) {
+            xmlAttrPtr attr;
+            for (attr = node->properties; attr; attr = attr->next)
+                size += sizeof(xmlAttr) + node_size(dict, attr->children);
+        }
+        if (node->type != XML_ENTITY_REF_NODE)
+            size += node_size(dict, node->children);
+    }
+    return size;
+}
+
+static apr_size_t doc_size(xmlDocPtr doc)
+{
+    return doc ? sizeof(xmlDoc) + node_size(doc->dict, doc->children) : 0;
+}
+
+static apr_size_t stylesheet_size(xsltStylesheetPtr style)
+{
+    apr_size_t size = sizeof(xsltStylesheet) + doc_size(style->doc);
+    xsltTemplatePtr tmpl;
+    xsltElemPreCompPtr comp;
+    xsltDocumentPtr include;
+    xsltStylesheetPtr import;
+
+    for (tmpl = style->templates; tmpl; tmpl = tmpl->next)
+        size += sizeof(xsltTemplate);
+    for (comp = style->preComps; comp; comp = comp->next)
+        size += sizeof(xsltStylePreComp);
+    for (include = style->docList; include; include = include->next)
+        size += sizeof(xsltDocument) + doc_size(include->doc);
+    for (import = style->imports; import; import = import->next)
+        size += stylesheet_size(import);
+    return size;
+}
+
+static apr_size_t entry_size(xsltStylesheetPtr style)
+{
+    apr_size_t size = stylesheet_size(style);
+
+    /* Imports share the dictionary of the top level stylesheet */
+    if (style->dict) {
+#if LIBXML_VERSION >= 20900
+        size += xmlDictGetUsage(style->dict);
+#else
+        size += xmlDictSize(style->dict) * 32;
+#endif
+    }
+    return size;
+}
+
+/**
+ * Purity analysis
+ *
+ * A stylesheet is pure when its output depends on nothing but the input,
+ * the files it reads and the request data it reports reading (see
+ * transform_output.c).  Every expression in the stylesheet and its
+ * imports and includes is scanned for calls to extension functions;
+ * anything reading the clock or a random source, or evaluating XPath
+ * built at run time, makes it impure, and so does any function we don't
+ * know about.  So does any extension element we don't know about.
+ */
+typedef struct
+{
+    const xmlChar *ns;
+    const char *name;           /* NULL for all of them */
+    int without_args;           /* only when called without arguments */
+}
+transform_impure_function;
+
+static const transform_impure_function impure_functions[] = {
+    /* The date functions default to the current date and time */
+    {EXSLT_DATE_NAMESPACE, NULL, 1},
+    {EXSLT_MATH_NAMESPACE, "random", 0},
+    {EXSLT_DYNAMIC_NAMESPACE, "evaluate", 0},
+    {SAXON_NAMESPACE, "evaluate", 0},
+    {SAXON_NAMESPACE, "expression", 0},
+    {SAXON_NAMESPACE, "eval", 0},
+    {NULL, NULL, 0}
+};
+
+/* Namespaces whose other functions only look at their arguments */
+static const xmlChar *const pure_namespaces[] = {
+    /* These report what they read of the request */
+    TRANSFORM_APACHE_NAMESPACE,
+    TRANSFORM_HTTP_NAMESPACE,
+    EXSLT_COMMON_NAMESPACE,
+    EXSLT_CRYPTO_NAMESPACE,
+    EXSLT_MATH_NAMESPACE,
+    EXSLT_SETS_NAMESPACE,
+    EXSLT_FUNCTIONS_NAMESPACE,
+    EXSLT_STRINGS_NAMESPACE,
+    EXSLT_DATE_NAMESPACE,
+    EXSLT_DYNAMIC_NAMESPACE,
+    SAXON_NAMESPACE,
+    NULL
+};
+
+/* Namespaces of extension elements that only produce output */
+static const xmlChar *const pure_element_namespaces[] = {
+    /* apache:cache remembers what its body read */
+    TRANSFORM_APACHE_NAMESPACE,
+    EXSLT_FUNCTIONS_NAMESPACE,
+    NULL
+};
+
+typedef struct
+{
+    apr_pool_t *pool;
+    apr_hash_t *functions;      /* func:function definitions, "{ns}name" */
+    xsltStylesheetPtr style;    /* being scanned */
+    int impure;
+}
+transform_purity;
+
+#define IS_NAME_CHAR(c) (apr_isalnum(c) || (c) == '_' || (c) == '-' \
+                         || (c) == '.' || ((unsigned char) (c)) >= 0x80)
+
+static int function_pure(transform_purity *ctx, const xmlChar *ns,
+                         const char *name, int without_args)
+{
+    const transform_impure_function *fn;
+    const xmlChar *const *pure;
+
+    for (fn = impure_functions; fn->ns; fn++) {
+        if (xmlStrEqual(ns, fn->ns)
+            && (!fn->name || !strcmp(name, fn->name))
+            && (!fn->without_args || without_args))
+            return 0;
+    }
+    for (pure = pure_namespaces; *pure; pure++) {
+        if (xmlStrEqual(ns, *pure))
+            return 1;
+    }
+    return apr_hash_get(ctx->functions,
+                        apr_pstrcat(ctx->pool, "{", ns, "}", name, NULL),
+                        APR_HASH_KEY_STRING) != NULL;
+}
+
+/* Whether node is an extension element we can vouch for */
+static int element_pure(transform_purity *ctx, xmlNodePtr node)
+{
+    const xmlChar *const *pure;
+
+    if (!node->ns || xmlStrEqual(node->ns->href, XSLT_NAMESPACE)
+        || !xsltCheckExtURI(ctx->style, node->ns->href))
+        return 1;
+    for (pure = pure_element_namespaces; *pure; pure++) {
+        if (xmlStrEqual(node->ns->href, *pure))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Look for "prefix:name(" in an attribute value.  This finds calls in
+ * expressions and in attribute value templates alike; a string literal
+ * that happens to look like a call only makes the result conservative.
+ */
+static void scan_expression(transform_purity *ctx, xmlNodePtr node,
+                            const char *expr)
+{
+    const char *colon;
+
+    for (colon = strchr(expr, ':'); colon && !ctx->impure;
+         colon = strchr(colon + 1, ':')) {
+        const char *start = colon;
+        const char *end = colon + 1;
+        char *prefix;
+        char *name;
+        xmlNsPtr ns;
+        int without_args;
+
+        /* Skip axes such as child:: */
+        if (*end == ':') {
+            colon++;
+            continue;
+        }
+        while (start > expr && IS_NAME_CHAR(start[-1]))
+            start--;
+        while (IS_NAME_CHAR(*end))
+            end++;
+        if (start == colon || end == colon + 1 || apr_isdigit(*start))
+            continue;
+        name = apr_pstrndup(ctx->pool, colon + 1, end - colon - 1);
+        while (apr_isspace(*end))
+            end++;
+        if (*end++ != '(')
+            continue;
+        while (apr_isspace(*end))
+            end++;
+        without_args = *end == ')';
+
+        prefix = apr_pstrndup(ctx->pool, start, colon - start);
+        ns = xmlSearchNs(node->doc, node, (const xmlChar *) prefix);
+        if (ns && ns->href && !function_pure(ctx, ns->href, name,
+                                             without_args))
+            ctx->impure = 1;
+    }
+}
+
+static void scan_node(transform_purity *ctx, xmlNodePtr node, int define)
+{
+    for (; node && !ctx->impure; node = node->next) {
+        xmlAttrPtr attr;
+
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+
+        if (define) {
+            /* Remember func:function names so calls to them are known */
+            if (node->ns && xmlStrEqual(node->ns->href,
+                                        EXSLT_FUNCTIONS_NAMESPACE)
+                && xmlStrEqual(node->name, (const xmlChar *) "function")) {
+                xmlChar *qname = xmlGetNsProp(node, (const xmlChar *) "name",
+                                              NULL);
+                xmlChar *local = NULL;
+                xmlChar *prefix = NULL;
+                xmlNsPtr ns;
+
+                if (qname && (local = xmlSplitQName2(qname, &prefix))
+                    && (ns = xmlSearchNs(node->doc, node, prefix))) {
+                    const char *key = apr_pstrcat(ctx->pool, "{", ns->href,
+                                                  "}", local, NULL);
+                    apr_hash_set(ctx->functions, key, APR_HASH_KEY_STRING,
+                                 key);
+                }
+                xmlFree(local);
+                xmlFree(prefix);
+                xmlFree(qname);
+            }
+        }
+        else if (!element_pure(ctx, node)) {
+            ctx->impure = 1;
+        }
+        else {
+            for (attr = node->properties; attr && !ctx->impure;
+                 attr = attr->next) {
+                xmlChar *value = xmlNodeListGetString(node->doc,
+                                                      attr->children, 1);
+                if (value) {
+                    scan_expression(ctx, node, (const char *) value);
+                    xmlFree(value);
+                }
+            }
+        }
+        scan_node(ctx, node->children, define);
+    }
+}
+
+static void scan_stylesheet(transform_purity *ctx, xsltStylesheetPtr style,
+                            int define)
+{
+    xsltDocumentPtr include;
+    xsltStylesheetPtr import;
+
+    ctx->style = style;
+    if (style->doc)
+        scan_node(ctx, style->doc->children, define);
+    for (include = style->docList; include; include = include->next) {
+        if (include->doc)
+            scan_node(ctx, include->doc->children, define);
+    }
+    for (import = style->imports; import; import = import->next)
+        scan_stylesheet(ctx, import, define);
+    ctx->style = style;
+}
+
+static int stylesheet_pure(apr_pool_t *p, xsltStylesheetPtr style)
+{
+    transform_purity ctx;
+
+    ctx.pool = p;
+    ctx.functions = apr_hash_make(p);
+    ctx.impure = 0;
+    scan_stylesheet(&ctx, style, 1);
+    scan_stylesheet(&ctx, style, 0);
+    return !ctx.impure;
+}
+
+/**
+ * Wrap a freshly compiled stylesheet in an entry holding one reference.
+ * The entry's own pool is a root pool so it can be destroyed from any
+ * thread.  When holder is given the entry struct itself is allocated
+ * there and outlives the stylesheet, which is what lets
+ * transform_cache_get pin entries without a lock.  Returns 0 in
+ * *stable when a dependency could not be stat'ed.
+ */
+static transform_xslt_entry *entry_create(apr_pool_t *holder,
+                                          const char *path,
+                                          xsltStylesheetPtr xslt,
+                                          int *stable)
+{
+    apr_pool_t *pool;
+    transform_xslt_entry *entry;
+
+    apr_pool_create(&pool, NULL);
+    entry = apr_pcalloc(holder ? holder : pool, sizeof(transform_xslt_entry));
+    entry->pool = pool;
+    entry->path = apr_pstrdup(pool, path);
+    entry->transform = xslt;
+    entry->deps = apr_array_make(pool, 4, sizeof(transform_xslt_dep));
+    collect_deps(entry->deps, xslt);
+    entry->size = entry_size(xslt);
+    {
+        apr_pool_t *scratch;
+        apr_pool_create(&scratch, pool);
+        entry->pure = stylesheet_pure(scratch, xslt);
+        apr_pool_destroy(scratch);
+    }
+    entry->refcount = 1;
+    entry->freed = 0;
+
+    *stable = stat_deps(entry->deps, 0, pool);
+    return entry;
+}
+
+void transform_cache_release(transform_xslt_entry *entry)
+{
+    if (apr_atomic_dec32(&entry->refcount) == 0
+        && apr_atomic_cas32(&entry->freed, 1, 0) == 0) {
+        xsltFreeStylesheet(entry->transform);
+        apr_pool_destroy(entry->pool);
+    }
+}
+
+/* Static Style Sheet Caching (TransformCache) */
+transform_xslt_entry *transform_cache_get(svr_cfg * sconf,
+                                          const char *descriptor)
+{
+    transform_xslt_index *index;
+    transform_xslt_slot *slot;
+    transform_xslt_entry *entry;
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    unsigned int hash;
+    unsigned int i;
+
+    /* A single pointer load; snapshots are never modified once published */
+    index = sconf->index;
+    if (!descriptor || !index)
         return 0;
 
-    for (p = sconf->data; p; p = p->next) {
-        if (!strcmp(descriptor, p->id)) {
-            return p->transform;
+    hash = apr_hashfunc_default(descriptor, &len);
+    for (i = hash & index->mask; (slot = &index->slots[i])->entry;
+         i = (i + 1) & index->mask) {
+        if (slot->hash == hash && !strcmp(descriptor, slot->entry->id)) {
+            /**
+             * Pin the current compiled version.  If a reload swapped it
+             * out between the load and the increment our reference may be
+             * on an entry already on its way out, so drop it and retry;
+             * the struct itself is never freed, only its stylesheet.
+             */
+            for (;;) {
+                entry = slot->entry->current;
+                apr_atomic_inc32(&entry->refcount);
+                if (entry == slot->entry->current)
+                    return entry;
+                transform_cache_release(entry);
+            }
         }
     }
 
     return 0;
 }
 
+/**
+ * Build a fresh index over conf->data and publish it.  Called once the
+ * configuration has been read; calling it again after adding entries
+ * swaps in a new snapshot while readers carry on with the old one.
+ */
+void transform_cache_index(apr_pool_t *p, svr_cfg * conf)
+{
+    transform_xslt_index *index;
+    transform_xslt_cache *c;
+    unsigned int count = 0;
+    unsigned int size = 8;
+
+    for (c = conf->data; c; c = c->next)
+        count++;
+    /* Keep the load factor at or below one half so probes stay short */
+    while (size < count * 2)
+        size <<= 1;
+
+    index = apr_palloc(p, sizeof(transform_xslt_index));
+    index->mask = size - 1;
+    index->slots = apr_pcalloc(p, size * sizeof(transform_xslt_slot));
+
+    for (c = conf->data; c; c = c->next) {
+        apr_ssize_t len = APR_HASH_KEY_STRING;
+        unsigned int hash = apr_hashfunc_default(c->id, &len);
+        unsigned int i = hash & index->mask;
+
+        while (index->slots[i].entry) {
+            /* The list is newest first; later duplicates stay shadowed */
+            if (index->slots[i].hash == hash
+                && !strcmp(index->slots[i].entry->id, c->id))
+                break;
+            i = (i + 1) & index->mask;
+        }
+        if (!index->slots[i].entry) {
+            index->slots[i].hash = hash;
+            index->slots[i].entry = c;
+        }
+    }
+
+    /* The old snapshot lives in the config pool, so late readers are safe */
+    apr_atomic_xchgptr((volatile void **) &conf->index, index);
+}
+
+/**
+ * TransformCache only records the stylesheet here.  Compiling waits for
+ * transform_cache_compile so all entries can be compiled in parallel
+ * once the whole configuration has been read.
+ */
 const char *transform_cache_add(cmd_parms * cmd, void *cfg,
                                             const char *url, const char *path)
 {
     svr_cfg *conf = ap_get_module_config(cmd->server->module_config,
                                          &transform_module);
-    xsltStylesheetPtr xslt = xsltParseStylesheetFile(path);
-    if (url && path && xslt) {
+    if (url && path) {
         transform_xslt_cache *me =
             apr_palloc(cmd->pool, sizeof(transform_xslt_cache));
         me->id = apr_pstrdup(cmd->pool, url);
-        me->transform = xslt;
+        me->path = apr_pstrdup(cmd->pool, path);
+        me->current = NULL;
         me->next = conf->data;
         conf->data = me;
-        ap_log_perror(APLOG_MARK, APLOG_NOTICE, 0, cmd->pool,
-                      "mod_transform: Cached Precompiled XSL: %s", url);
         return NULL;
     }
     else {
-        ap_log_perror(APLOG_MARK, APLOG_ERR, 0, cmd->pool,
-                      "mod_transform: Error fetching or compiling XSL from: %s",
-                      path);
-        return "Error trying to precompile XSLT";
+        return "TransformCache takes a URL and a Path";
     }
 }
 
+typedef struct transform_compile_job
+{
+    const char *key;
+    const char *path;
+    apr_array_header_t *slots;  /* every transform_xslt_cache using it */
+    transform_xslt_entry *reuse;
+    xsltStylesheetPtr xslt;
+}
+transform_compile_job;
+
+/**
+ * Process lifetime stylesheet store.  It lives in the process pool, so
+ * unlike the server configs it survives graceful restarts, and holds one
+ * reference on every entry compiled for the current generation.
+ */
+typedef struct transform_xslt_store
+{
+    apr_pool_t *pool;
+    apr_hash_t *entries;        /* canonical_key -> transform_xslt_entry */
+}
+transform_xslt_store;
+
+static transform_xslt_store *store_get(apr_pool_t *process_pool)
+{
+    void *data;
+    transform_xslt_store *store;
+
+    apr_pool_userdata_get(&data, "mod_transform_store", process_pool);
+    if (data)
+        return data;
+
+    store = apr_pcalloc(process_pool, sizeof(transform_xslt_store));
+    apr_pool_create(&store->pool, process_pool);
+    store->entries = apr_hash_make(store->pool);
+    apr_pool_userdata_set(store, "mod_transform_store",
+                          apr_pool_cleanup_null, process_pool);
+    return store;
+}
+
+/**
+ * Swap in the entries used by this configuration, dropping the store's
+ * reference on anything the new configuration no longer mentions.
+ */
+static void store_replace(transform_xslt_store *store,
+                          apr_array_header_t *jobs, apr_pool_t *process_pool)
+{
+    apr_pool_t *pool;
+    apr_hash_t *entries;
+    apr_hash_index_t *hi;
+    int i;
+
+    apr_pool_create(&pool, process_pool);
+    entries = apr_hash_make(pool);
+    for (i = 0; i < jobs->nelts; i++) {
+        transform_compile_job *job = &APR_ARRAY_IDX(jobs, i,
+                                                    transform_compile_job);
+        transform_xslt_entry *entry = APR_ARRAY_IDX(job->slots, 0,
+                                                    transform_xslt_cache *)->current;
+        if (entry)
+            apr_hash_set(entries, apr_pstrdup(pool, job->key),
+                         APR_HASH_KEY_STRING, entry);
+    }
+
+    for (hi = apr_hash_first(pool, store->entries); hi;
+         hi = apr_hash_next(hi)) {
+        const void *key;
+        void *entry;
+
+        apr_hash_this(hi, &key, NULL, &entry);
+        if (apr_hash_get(entries, key, APR_HASH_KEY_STRING) != entry)
+            transform_cache_release(entry);
+    }
+
+    apr_pool_destroy(store->pool);
+    store->pool = pool;
+    store->entries = entries;
+}
+
+/**
+ * In a child the store's references would only pin stylesheets a reload
+ * has replaced, so they are dropped, leaving the slots the only owners.
+ * The parent's copy of the store is untouched.
+ */
+static void store_release(transform_xslt_store *store)
+{
+    apr_hash_index_t *hi;
+    void *entry;
+
+    for (hi = apr_hash_first(store->pool, store->entries); hi;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &entry);
+        transform_cache_release(entry);
+    }
+    store->entries = apr_hash_make(store->pool);
+}
+
+typedef struct transform_compile_queue
+{
+    transform_compile_job *jobs;
+    apr_uint32_t count;
+    volatile apr_uint32_t next;
+}
+transform_compile_queue;
+
+static void compile_jobs(transform_compile_queue *queue)
+{
+    apr_uint32_t i;
+
+    while ((i = apr_atomic_inc32(&queue->next)) < queue->count) {
+        transform_compile_job *job = &queue->jobs[i];
+        if (!job->reuse)
+            job->xslt = xsltParseStylesheetFile((const xmlChar *) job->path);
+    }
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC compile_thread(apr_thread_t *thd, void *data)
+{
+    compile_jobs(data);
+    return NULL;
+}
+#endif
+
+static int compile_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * Key identifying the file behind a TransformCache path: its canonical
+ * path plus device, inode, size and mtime.  Servers naming the same file,
+ * however they spell it, end up sharing one compiled stylesheet.
+ */
+static const char *canonical_key(apr_pool_t *p, const char *path)
+{
+    apr_finfo_t finfo;
+    char *real = realpath(path, NULL);
+    const char *key = apr_pstrdup(p, real ? real : path);
+
+    if (real)
+        free(real);
+    if (apr_stat(&finfo, key, APR_FINFO_IDENT | APR_FINFO_SIZE
+                 | APR_FINFO_MTIME, p) != APR_SUCCESS)
+        return key;
+    return apr_psprintf(p, "%s:%" APR_UINT64_T_HEX_FMT ":%"
+                        APR_UINT64_T_HEX_FMT ":%" APR_OFF_T_FMT ":%"
+                        APR_TIME_T_FMT, key, (apr_uint64_t) finfo.device,
+                        (apr_uint64_t) finfo.inode, finfo.size, finfo.mtime);
+}
+
+/**
+ * Compile every TransformCache entry that has not been compiled yet, on as
+ * many threads as there are CPUs.  Each distinct file is compiled once and
+ * shared by reference between all the servers caching it.  Entries that
+ * fail are logged one by one, as transform_cache_add used to, and make
+ * startup fail.
+ */
+apr_status_t transform_cache_compile(apr_pool_t *p, apr_pool_t *ptemp,
+                                     server_rec *s)
+{
+    transform_compile_queue queue;
+    apr_array_header_t *jobs;
+    apr_hash_t *files;
+    server_rec *vhost;
+    transform_xslt_store *store = store_get(s->process->pool);
+    apr_status_t rv = APR_SUCCESS;
+    int nthreads;
+    int stale;
+    int i;
+
+    jobs = apr_array_make(ptemp, 16, sizeof(transform_compile_job));
+    files = apr_hash_make(ptemp);
+    for (vhost = s; vhost; vhost = vhost->next) {
+        transform_xslt_cache *c;
+        svr_cfg *sconf = ap_get_module_config(vhost->module_config,
+                                              &transform_module);
+        for (c = sconf->data; c; c = c->next) {
+            const char *key;
+            int *job_index;
+
+            if (c->current)
+                continue;
+            key = canonical_key(ptemp, c->path);
+            job_index = apr_hash_get(files, key, APR_HASH_KEY_STRING);
+            if (!job_index) {
+                transform_compile_job *job = apr_array_push(jobs);
+                job->key = key;
+                job->path = c->path;
+                job->reuse = apr_hash_get(store->entries, key,
+                                          APR_HASH_KEY_STRING);
+                /* Left over from before a restart, but did its imports change? */
+                if (job->reuse && !stat_deps(job->reuse->deps, 1, ptemp))
+                    job->reuse = NULL;
+                job->slots = apr_array_make(ptemp, 1,
+                                            sizeof(transform_xslt_cache *));
+                job->xslt = NULL;
+                job_index = apr_palloc(ptemp, sizeof(int));
+                *job_index = jobs->nelts - 1;
+                apr_hash_set(files, key, APR_HASH_KEY_STRING, job_index);
+            }
+            APR_ARRAY_PUSH(APR_ARRAY_IDX(jobs, *job_index,
+                                         transform_compile_job).slots,
+                           transform_xslt_cache *) = c;
+        }
+    }
+    if (!jobs->nelts) {
+        store_replace(store, jobs, s->process->pool);
+        return APR_SUCCESS;
+    }
+
+    queue.jobs = (transform_compile_job *) jobs->elts;
+    queue.count = jobs->nelts;
+    queue.next = 0;
+
+    /* libxml has to be initialised before threads use it */
+    xmlInitParser();
+
+    for (i = 0, stale = 0; i < jobs->nelts; i++) {
+        if (!queue.jobs[i].reuse)
+            stale++;
+    }
+    nthreads = compile_threads();
+    if (nthreads > stale)
+        nthreads = stale;
+
+#if APR_HAS_THREADS
+    if (nthreads > 1) {
+        apr_thread_t **threads = apr_palloc(ptemp,
+                                            nthreads * sizeof(apr_thread_t *));
+        int started;
+
+        for (started = 0; started < nthreads; started++) {
+            if (apr_thread_create(&threads[started], NULL, compile_thread,
+                                  &queue, ptemp) != APR_SUCCESS)
+                break;
+        }
+        /* Whatever the threads didn't get to is done right here */
+        compile_jobs(&queue);
+        for (i = 0; i < started; i++) {
+            apr_status_t thread_rv;
+            apr_thread_join(&thread_rv, threads[i]);
+        }
+    }
+#endif
+    compile_jobs(&queue);
+
+    for (i = 0; i < jobs->nelts; i++) {
+        transform_compile_job *job = &queue.jobs[i];
+        transform_xslt_entry *entry;
+        int stable;
+        int j;
+
+        if (job->reuse) {
+            entry = job->reuse;
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                         "mod_transform: %s is unchanged, not recompiling",
+                         job->path);
+        }
+        else if (job->xslt) {
+            /**
+             * The reference it comes with belongs to the store.  The struct
+             * must outlive pconf, so it comes from the process pool.
+             */
+            entry = entry_create(s->process->pool, job->path, job->xslt,
+                                 &stable);
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "mod_transform: Error fetching or compiling XSL from: %s",
+                         job->path);
+            rv = APR_EGENERAL;
+            continue;
+        }
+
+        /* One more reference per server holding it */
+        for (j = 0; j < job->slots->nelts; j++) {
+            transform_xslt_cache *c =
+                APR_ARRAY_IDX(job->slots, j, transform_xslt_cache *);
+            apr_atomic_inc32(&entry->refcount);
+            c->current = entry;
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                         "mod_transform: Cached Precompiled XSL: %s", c->id);
+        }
+    }
+
+    store_replace(store, jobs, s->process->pool);
+    return rv;
+}
+
 apr_status_t transform_cache_free(void *conf)
 {
     transform_xslt_cache *p;
     svr_cfg *cfg = conf;
     for (p = cfg->data; p; p = p->next) {
-        xsltFreeStylesheet(p->transform);
+        if (p->current)
+            transform_cache_release(p->current);
     }
     return APR_SUCCESS;
 }
 
+/* Runtime Style Sheet Caching
+ *
+ * Stylesheets named by TransformSet, mod_transform_set_XSLT, the default
+ * XSLT or an xml-stylesheet PI are compiled on first use and kept for the
+ * life of the child.  An entry is thrown away as soon as the stylesheet or
+ * anything it imports or includes changes on disk, or when it is the
+ * least recently used one and TransformCacheMaxBytes is exceeded.
+ *
+ * Each entry is charged to the server that compiled it.  The main
+ * server's TransformCacheMaxBytes limits the whole cache, a virtual
+ * host's limits what is charged to it.  TransformCache stylesheets are
+ * not part of this cache and are never evicted.
+ */
+static apr_pool_t *runtime_pool = NULL;
+static apr_hash_t *runtime_cache = NULL;
+static server_rec *runtime_server = NULL;
+static svr_cfg *runtime_main = NULL;
+static apr_size_t runtime_bytes = 0;
+static transform_xslt_entry *runtime_mru = NULL;
+static transform_xslt_entry *runtime_lru = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *runtime_lock = NULL;
+#endif
+
+static void runtime_lock_acquire(void)
+{
+#if APR_HAS_THREADS
+    if (runtime_lock)
+        apr_thread_mutex_lock(runtime_lock);
+#endif
+}
+
+static void runtime_lock_release(void)
+{
+#if APR_HAS_THREADS
+    if (runtime_lock)
+        apr_thread_mutex_unlock(runtime_lock);
+#endif
+}
+
+/* The helpers below are called with runtime_lock held */
+static void runtime_link(transform_xslt_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = runtime_mru;
+    if (runtime_mru)
+        runtime_mru->lru_prev = entry;
+    runtime_mru = entry;
+    if (!runtime_lru)
+        runtime_lru = entry;
+}
+
+static void runtime_unlink(transform_xslt_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        runtime_mru = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        runtime_lru = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void runtime_insert(transform_xslt_entry *entry, svr_cfg *owner)
+{
+    entry->owner = owner;
+    apr_hash_set(runtime_cache, entry->path, APR_HASH_KEY_STRING, entry);
+    runtime_link(entry);
+    runtime_bytes += entry->size;
+    owner->cache_bytes += entry->size;
+}
+
+/* The cache's reference is handed to the caller, to release unlocked */
+static void runtime_remove(transform_xslt_entry *entry)
+{
+    apr_hash_set(runtime_cache, entry->path, APR_HASH_KEY_STRING, NULL);
+    runtime_unlink(entry);
+    runtime_bytes -= entry->size;
+    entry->owner->cache_bytes -= entry->size;
+}
+
+static int owner_over_budget(svr_cfg *owner)
+{
+    return owner != runtime_main && owner->cache_max_bytes > 0
+        && owner->cache_bytes > (apr_size_t) owner->cache_max_bytes;
+}
+
+static int cache_over_budget(void)
+{
+    return runtime_main->cache_max_bytes > 0
+        && runtime_bytes > (apr_size_t) runtime_main->cache_max_bytes;
+}
+
+/* Evict least recently used entries until owner and the cache fit */
+static void runtime_evict(svr_cfg *owner, apr_array_header_t *evicted)
+{
+    transform_xslt_entry *entry;
+    transform_xslt_entry *prev;
+
+    for (entry = runtime_lru; entry && owner_over_budget(owner);
+         entry = prev) {
+        prev = entry->lru_prev;
+        if (entry->owner == owner) {
+            runtime_remove(entry);
+            APR_ARRAY_PUSH(evicted, transform_xslt_entry *) = entry;
+        }
+    }
+    while (runtime_lru && cache_over_budget()) {
+        entry = runtime_lru;
+        runtime_remove(entry);
+        APR_ARRAY_PUSH(evicted, transform_xslt_entry *) = entry;
+    }
+}
+
+static apr_status_t reload_start(apr_pool_t *p, server_rec *s);
+
+apr_status_t transform_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+
+    rv = apr_pool_create(&runtime_pool, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+    runtime_cache = apr_hash_make(runtime_pool);
+    runtime_server = s;
+    runtime_main = ap_get_module_config(s->module_config, &transform_module);
+    store_release(store_get(s->process->pool));
+
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&runtime_lock, APR_THREAD_MUTEX_DEFAULT,
+                                 runtime_pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_transform: Unable to create stylesheet cache lock");
+        runtime_cache = NULL;
+        return rv;
+    }
+#endif
+    return reload_start(p, s);
+}
+
+/**
+ * Map a stylesheet name onto the local file libxml will end up reading,
+ * the same way find_relative_uri does.  Returns NULL when the name has no
+ * stable file identity (ApacheFS subrequests, remote URIs) and must not be
+ * cached.
+ */
+const char *transform_cache_resolve(ap_filter_t * f, const char *name)
+{
+    char *path;
+    dir_cfg *dconf = ap_get_module_config(f->r->per_dir_config,
+                                          &transform_module);
+
+    if (!name || !runtime_cache || (dconf->opts & USE_APACHE_FS))
+        return NULL;
+
+    if (!strncmp(name, "file://", 7)) {
+        name += 7;
+    }
+    else if (ap_strstr_c(name, "://")) {
+        return NULL;
+    }
+
+    if (name[0] != '/' && f->r->filename) {
+        if (apr_filepath_merge(&path,
+                               ap_make_dirstr_parent(f->r->pool,
+                                                     f->r->filename),
+                               name, 0, f->r->pool) != APR_SUCCESS)
+            return NULL;
+        return path;
+    }
+    return name[0] == '/' ? name : NULL;
+}
+
+/**
+ * Returns a compiled stylesheet for a resolved path, compiling it if it is
+ * not cached yet or the cached copy is out of date.  The caller must hand
+ * the entry back with transform_cache_release once the transform is done.
+ */
+transform_xslt_entry *transform_cache_acquire(request_rec *r,
+                                              const char *path)
+{
+    transform_xslt_entry *entry;
+    transform_xslt_entry *old;
+    xsltStylesheetPtr xslt;
+    apr_array_header_t *evicted;
+    svr_cfg *owner = ap_get_module_config(r->server->module_config,
+                                          &transform_module);
+    int stable;
+    int i;
+
+    runtime_lock_acquire();
+    entry = apr_hash_get(runtime_cache, path, APR_HASH_KEY_STRING);
+    if (entry) {
+        apr_atomic_inc32(&entry->refcount);
+        runtime_unlink(entry);
+        runtime_link(entry);
+    }
+    runtime_lock_release();
+
+    if (entry) {
+        if (stat_deps(entry->deps, 1, r->pool))
+            return entry;
+
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "mod_transform: Stylesheet changed, recompiling: %s",
+                      path);
+        runtime_lock_acquire();
+        old = apr_hash_get(runtime_cache, path, APR_HASH_KEY_STRING);
+        if (old == entry)
+            runtime_remove(entry);
+        runtime_lock_release();
+        if (old == entry)
+            transform_cache_release(entry);
+        transform_cache_release(entry);
+    }
+
+    xslt = xsltParseStylesheetFile((const xmlChar *) path);
+    if (!xslt)
+        return NULL;
+
+    entry = entry_create(NULL, path, xslt, &stable);
+
+    /* Anything we cannot stat cannot be checked later, so don't keep it */
+    if (!stable) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "mod_transform: Not caching stylesheet %s", path);
+        return entry;
+    }
+
+    evicted = apr_array_make(r->pool, 4, sizeof(transform_xslt_entry *));
+    apr_atomic_inc32(&entry->refcount);
+    runtime_lock_acquire();
+    old = apr_hash_get(runtime_cache, entry->path, APR_HASH_KEY_STRING);
+    if (old) {
+        runtime_remove(old);
+        APR_ARRAY_PUSH(evicted, transform_xslt_entry *) = old;
+    }
+    runtime_insert(entry, owner);
+    runtime_evict(owner, evicted);
+    runtime_lock_release();
+
+    for (i = 0; i < evicted->nelts; i++) {
+        old = APR_ARRAY_IDX(evicted, i, transform_xslt_entry *);
+        if (old != entry)
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "mod_transform: Evicted stylesheet %s (%"
+                          APR_SIZE_T_FMT " bytes)", old->path, old->size);
+        transform_cache_release(old);
+    }
+
+    return entry;
+}
+
+/**
+ * Handler for "SetHandler transform-cache-status": reports the estimated
+ * size of every compiled stylesheet this child holds, to help size
+ * TransformCacheMaxBytes.
+ */
+int transform_cache_status(request_rec *r)
+{
+    transform_xslt_entry *entry;
+    apr_array_header_t *entries;
+    apr_array_header_t *usage;
+    apr_size_t total;
+    server_rec *vhost;
+    int i;
+
+    if (!r->handler || strcmp(r->handler, "transform-cache-status"))
+        return DECLINED;
+
+    ap_set_content_type(r, "text/plain");
+    if (r->header_only)
+        return OK;
+
+    /* Copy everything out first; don't write to the client with the lock */
+    entries = apr_array_make(r->pool, 16, sizeof(transform_xslt_entry));
+    usage = apr_array_make(r->pool, 16, sizeof(apr_size_t));
+    runtime_lock_acquire();
+    total = runtime_bytes;
+    for (entry = runtime_mru; entry; entry = entry->lru_next) {
+        transform_xslt_entry *copy = apr_array_push(entries);
+        *copy = *entry;
+        copy->path = apr_pstrdup(r->pool, entry->path);
+    }
+    for (vhost = runtime_server; vhost; vhost = vhost->next) {
+        svr_cfg *sconf = ap_get_module_config(vhost->module_config,
+                                              &transform_module);
+        APR_ARRAY_PUSH(usage, apr_size_t) = sconf->cache_bytes;
+    }
+    runtime_lock_release();
+
+    ap_rprintf(r, "Runtime stylesheet cache: %" APR_SIZE_T_FMT " bytes, "
+               "limit %" APR_OFF_T_FMT "\n", total,
+               runtime_main ? runtime_main->cache_max_bytes : 0);
+    for (i = 0; i < entries->nelts; i++) {
+        entry = &APR_ARRAY_IDX(entries, i, transform_xslt_entry);
+        ap_rprintf(r, "  %10" APR_SIZE_T_FMT "  %s\n", entry->size,
+                   entry->path);
+    }
+
+    ap_rputs("\nPer server (runtime / limit / TransformCache)\n", r);
+    for (vhost = runtime_server, i = 0; vhost; vhost = vhost->next, i++) {
+        svr_cfg *sconf = ap_get_module_config(vhost->module_config,
+                                              &transform_module);
+        transform_xslt_cache *c;
+        apr_size_t pinned = 0;
+
+        /* Entry structs are never freed, so reading a size is safe */
+        for (c = sconf->data; c; c = c->next) {
+            if (c->current)
+                pinned += c->current->size;
+        }
+        ap_rprintf(r, "  %s: %" APR_SIZE_T_FMT " / %" APR_OFF_T_FMT
+                   " / %" APR_SIZE_T_FMT "\n",
+                   vhost->server_hostname ? vhost->server_hostname : "-",
+                   APR_ARRAY_IDX(usage, i, apr_size_t),
+                   sconf->cache_max_bytes, pinned);
+    }
+    return OK;
+}
+
+/* TransformCache Hot Reloading
+ *
+ * Each child watches the directories holding its TransformCache
+ * stylesheets and their imports with inotify.  A single background thread
+ * waits for the events of a deploy to settle, then recompiles every
+ * affected entry one at a time and swaps the new version in.  Requests
+ * keep using the previous version until then, and since only this thread
+ * ever recompiles, no file is compiled twice at once.
+ */
+#if HAVE_SYS_INOTIFY_H && APR_HAS_THREADS
+
+#define RELOAD_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE \
+                       | IN_DELETE | IN_ATTRIB)
+/* How long the watched files have to be quiet before we recompile */
+#define RELOAD_SETTLE_MSEC 200
+
+typedef struct transform_reload_ctx
+{
+    server_rec *s;
+    apr_pool_t *pool;
+    apr_pool_t *scratch;
+    int fd;
+    volatile apr_uint32_t shutdown;
+    apr_thread_t *thread;
+    apr_hash_t *dirs;           /* directory -> watch descriptor */
+    apr_hash_t *wds;            /* watch descriptor -> directory */
+    apr_hash_t *files;          /* dependency path -> array of slots */
+    apr_hash_t *pending;        /* slot -> slot, waiting for recompile */
+}
+transform_reload_ctx;
+
+static void reload_watch(transform_reload_ctx *ctx, transform_xslt_cache *c)
+{
+    int i, j;
+    transform_xslt_entry *entry = c->current;
+    transform_xslt_dep *dep = (transform_xslt_dep *) entry->deps->elts;
+
+    for (i = 0; i < entry->deps->nelts; i++, dep++) {
+        apr_array_header_t *slots;
+        const char *dir = ap_make_dirstr_parent(ctx->pool, dep->path);
+
+        if (!apr_hash_get(ctx->dirs, dir, APR_HASH_KEY_STRING)) {
+            int *wd = apr_palloc(ctx->pool, sizeof(int));
+
+            *wd = inotify_add_watch(ctx->fd, dir, RELOAD_EVENTS);
+            if (*wd < 0) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, errno, ctx->s,
+                             "mod_transform: Cannot watch %s for changes",
+                             dir);
+                continue;
+            }
+            apr_hash_set(ctx->dirs, dir, APR_HASH_KEY_STRING, wd);
+            apr_hash_set(ctx->wds, wd, sizeof(int), dir);
+        }
+
+        slots = apr_hash_get(ctx->files, dep->path, APR_HASH_KEY_STRING);
+        if (!slots) {
+            slots = apr_array_make(ctx->pool, 1,
+                                   sizeof(transform_xslt_cache *));
+            apr_hash_set(ctx->files, apr_pstrdup(ctx->pool, dep->path),
+                         APR_HASH_KEY_STRING, slots);
+        }
+        for (j = 0; j < slots->nelts; j++) {
+            if (APR_ARRAY_IDX(slots, j, transform_xslt_cache *) == c)
+                break;
+        }
+        if (j == slots->nelts)
+            APR_ARRAY_PUSH(slots, transform_xslt_cache *) = c;
+    }
+}
+
+/**
+ * Recompile the stylesheet behind one slot.  Slots of different servers
+ * usually share their entry, so batch maps each old entry onto its
+ * replacement and the stylesheet is only compiled once per batch.
+ */
+static void reload_entry(transform_reload_ctx *ctx, transform_xslt_cache *c,
+                         apr_hash_t *batch)
+{
+    transform_xslt_entry *old = c->current;
+    transform_xslt_entry *entry;
+    xsltStylesheetPtr xslt;
+    int stable;
+
+    entry = apr_hash_get(batch, &old, sizeof(old));
+    if (!entry) {
+        /* Editors and deploy tools touch more than they change */
+        if (stat_deps(old->deps, 1, ctx->scratch))
+            entry = old;
+        else if ((xslt = xsltParseStylesheetFile((const xmlChar *) c->path)))
+            entry = entry_create(ctx->pool, c->path, xslt, &stable);
+        else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ctx->s,
+                         "mod_transform: Error recompiling XSL from: %s, "
+                         "keeping the previous version", c->path);
+            entry = old;
+        }
+        apr_hash_set(batch, apr_pmemdup(ctx->scratch, &old, sizeof(old)),
+                     sizeof(old), entry);
+    }
+    else if (entry != old) {
+        apr_atomic_inc32(&entry->refcount);
+    }
+
+    if (entry == old)
+        return;
+
+    apr_atomic_xchgptr((volatile void **) &c->current, entry);
+    transform_cache_release(old);
+    reload_watch(ctx, c);
+
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, ctx->s,
+                 "mod_transform: Reloaded Precompiled XSL: %s", c->id);
+}
+
+static void reload_read_events(transform_reload_ctx *ctx)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    char *ptr;
+
+    while ((len = read(ctx->fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            struct inotify_event *ev = (struct inotify_event *) ptr;
+            const char *dir;
+            apr_array_header_t *slots;
+            int i;
+
+            if (!ev->len)
+                continue;
+            dir = apr_hash_get(ctx->wds, &ev->wd, sizeof(int));
+            if (!dir)
+                continue;
+            slots = apr_hash_get(ctx->files,
+                                 apr_pstrcat(ctx->scratch, dir, ev->name,
+                                             NULL), APR_HASH_KEY_STRING);
+            for (i = 0; slots && i < slots->nelts; i++) {
+                transform_xslt_cache *c =
+                    APR_ARRAY_IDX(slots, i, transform_xslt_cache *);
+                apr_hash_set(ctx->pending, c, sizeof(c), c);
+            }
+        }
+    }
+}
+
+static void *APR_THREAD_FUNC reload_thread(apr_thread_t *thd, void *data)
+{
+    transform_reload_ctx *ctx = data;
+
+    while (!apr_atomic_read32(&ctx->shutdown)) {
+        struct pollfd pfd;
+        int pending = apr_hash_count(ctx->pending);
+
+        pfd.fd = ctx->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, pending ? RELOAD_SETTLE_MSEC : 1000) > 0) {
+            reload_read_events(ctx);
+        }
+        else if (pending) {
+            apr_hash_index_t *hi;
+            apr_hash_t *batch = apr_hash_make(ctx->scratch);
+
+            for (hi = apr_hash_first(ctx->scratch, ctx->pending); hi;
+                 hi = apr_hash_next(hi)) {
+                void *c;
+                apr_hash_this(hi, NULL, NULL, &c);
+                reload_entry(ctx, c, batch);
+            }
+            apr_pool_clear(ctx->scratch);
+            ctx->pending = apr_hash_make(ctx->scratch);
+        }
+    }
+    return NULL;
+}
+
+static apr_status_t reload_stop(void *data)
+{
+    apr_status_t rv;
+    transform_reload_ctx *ctx = data;
+
+    apr_atomic_set32(&ctx->shutdown, 1);
+    apr_thread_join(&rv, ctx->thread);
+    close(ctx->fd);
+    apr_pool_destroy(ctx->pool);
+    return APR_SUCCESS;
+}
+
+static apr_status_t reload_start(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t rv;
+    server_rec *vhost;
+    transform_reload_ctx *ctx = apr_pcalloc(p, sizeof(transform_reload_ctx));
+
+    ctx->s = s;
+    ctx->fd = -1;
+    /**
+     * Not a subpool of p: subpools go away before p's cleanups run, and
+     * the thread must be joined before its pool is destroyed.
+     */
+    apr_pool_create(&ctx->pool, NULL);
+    apr_pool_create(&ctx->scratch, ctx->pool);
+    ctx->dirs = apr_hash_make(ctx->pool);
+    ctx->wds = apr_hash_make(ctx->pool);
+    ctx->files = apr_hash_make(ctx->pool);
+    ctx->pending = apr_hash_make(ctx->scratch);
+
+    for (vhost = s; vhost; vhost = vhost->next) {
+        transform_xslt_cache *c;
+        svr_cfg *sconf = ap_get_module_config(vhost->module_config,
+                                              &transform_module);
+        if (!sconf->reload)
+            continue;
+        for (c = sconf->data; c; c = c->next) {
+            if (ctx->fd < 0) {
+                ctx->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                if (ctx->fd < 0) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, errno, s,
+                                 "mod_transform: inotify_init failed, "
+                                 "TransformCache entries will not reload");
+                    apr_pool_destroy(ctx->pool);
+                    return APR_SUCCESS;
+                }
+            }
+            reload_watch(ctx, c);
+        }
+    }
+
+    /* Nothing to watch */
+    if (ctx->fd < 0) {
+        apr_pool_destroy(ctx->pool);
+        return APR_SUCCESS;
+    }
+
+    rv = apr_thread_create(&ctx->thread, NULL, reload_thread, ctx, ctx->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "mod_transform: Unable to start stylesheet reload thread");
+        close(ctx->fd);
+        apr_pool_destroy(ctx->pool);
+        return rv;
+    }
+    apr_pool_cleanup_register(p, ctx, reload_stop, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
+#else
+
+static apr_status_t reload_start(apr_pool_t *p, server_rec *s)
+{
+    return APR_SUCCESS;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H && APR_HAS_THREADS */
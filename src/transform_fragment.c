@@ -0,0 +1,495 @@
+/**
+ *    Copyright (c) 2002 WebThing Ltd
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *    Authors:    Nick Kew <nick webthing.com>
+ *                Edward Rudd <urkle at outoforder dot com>
+ *                Paul Querna <chip at outoforder dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Fragment Caching
+ *
+ * <apache:cache key="..." ttl="..."> keeps the nodes its body produced,
+ * and for ttl seconds copies them into the output instead of running the
+ * templates again.  The key is an attribute value template and has to
+ * tell apart everything the body depends on besides files and request
+ * data, which are tracked: the files and request data the body read are
+ * kept with the nodes and reported again on every hit, and a change to
+ * one of the files makes the nodes stale before their time.
+ *
+ * Each child keeps the fragments it made in memory.  With shared="yes"
+ * and a TransformOutputCache directory they are also written there,
+ * serialized, for the other children to pick up.
+ */
+
+#include "mod_transform_private.h"
+#include "apr_md5.h"
+#include "apr_file_io.h"
+#include "apr_thread_rwlock.h"
+
+#include <libxslt/extensions.h>
+#include <libxslt/templates.h>
+#include <stdlib.h>
+
+/* Per child limits of the memory cache */
+#define FRAGMENT_MAX 1024
+#define FRAGMENT_MAX_BYTES (16 * 1024 * 1024)
+
+/**
+ * What evaluating a fragment read, one string each:
+ *   "H<header>", "A<argument>"       request data, as in notes->uses
+ *   "F<mtime> <inode> <size> <path>" a file, as it was then
+ *   "N"                              something that isn't a file
+ *   "U"                              something no key can describe
+ */
+typedef struct transform_fragment
+{
+    apr_pool_t *pool;
+    const char *id;
+    xmlDocPtr doc;              /* the root element holds the nodes */
+    apr_time_t expires;
+    apr_array_header_t *reads;
+    apr_size_t size;            /* serialized */
+}
+transform_fragment;
+
+#if APR_HAS_THREADS
+static apr_thread_rwlock_t *fragment_lock;
+#endif
+static apr_pool_t *fragment_pool;
+static apr_hash_t *fragments;
+static apr_size_t fragment_bytes;
+
+static const char *fragment_id(request_rec *r, xmlNodePtr inst,
+                               const xmlChar *key)
+{
+    apr_md5_ctx_t md5;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    const char *parts[4];
+    char *hex;
+    int i;
+
+    parts[0] = r->server->server_hostname ? r->server->server_hostname : "";
+    parts[1] = inst->doc && inst->doc->URL ? (const char *) inst->doc->URL
+        : "";
+    parts[2] = apr_ltoa(r->pool, xmlGetLineNo(inst));
+    parts[3] = (const char *) key;
+
+    apr_md5_init(&md5);
+    for (i = 0; i < sizeof(parts) / sizeof(*parts); i++)
+        apr_md5_update(&md5, parts[i], strlen(parts[i]) + 1);
+    apr_md5_final(digest, &md5);
+
+    hex = apr_palloc(r->pool, APR_MD5_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++)
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return hex;
+}
+
+/* Whether every file a fragment read is still what it was */
+static int fragment_current(request_rec *r, apr_array_header_t *reads)
+{
+    apr_finfo_t finfo;
+    int i;
+
+    for (i = 0; i < reads->nelts; i++) {
+        const char *read = APR_ARRAY_IDX(reads, i, const char *);
+        apr_int64_t mtime, inode, size;
+        char *end;
+
+        if (*read != 'F')
+            continue;
+        mtime = apr_strtoi64(read + 1, &end, 10);
+        inode = apr_strtoi64(end, &end, 10);
+        size = apr_strtoi64(end, &end, 10);
+        if (*end != ' '
+            || apr_stat(&finfo, end + 1, APR_FINFO_MTIME | APR_FINFO_SIZE
+                        | APR_FINFO_INODE, r->pool) != APR_SUCCESS
+            || finfo.mtime != mtime || finfo.inode != inode
+            || finfo.size != size)
+            return 0;
+    }
+    return 1;
+}
+
+/* Report what a fragment read as read by this request */
+static void fragment_replay(request_rec *r, apr_array_header_t *reads)
+{
+    int i;
+
+    for (i = 0; i < reads->nelts; i++) {
+        const char *read = APR_ARRAY_IDX(reads, i, const char *);
+
+        switch (*read) {
+        case 'H':
+            mod_transform_used_header(r, read + 1);
+            break;
+        case 'A':
+            mod_transform_used_arg(r, read + 1);
+            break;
+        case 'F':
+            read = strchr(read, ' ');
+            read = read ? strchr(read + 1, ' ') : NULL;
+            read = read ? strchr(read + 1, ' ') : NULL;
+            if (read)
+                transform_add_dep(r, read + 1);
+            break;
+        case 'N':
+            transform_add_dep(r, NULL);
+            break;
+        case 'U':
+            mod_transform_uncacheable(r);
+            break;
+        }
+    }
+}
+
+/* Copy the children of from to where the transform is writing */
+static void fragment_copy(xsltTransformContextPtr ctxt, xmlNodePtr from)
+{
+    xmlNodePtr child;
+
+    for (child = from ? from->children : NULL; child; child = child->next)
+        xmlAddChild(ctxt->insert, xmlDocCopyNode(child, ctxt->output, 1));
+}
+
+static void fragment_free(transform_fragment * frag)
+{
+    apr_hash_set(fragments, frag->id, APR_HASH_KEY_STRING, NULL);
+    fragment_bytes -= frag->size;
+    xmlFreeDoc(frag->doc);
+    apr_pool_destroy(frag->pool);
+}
+
+static int fragment_hit(xsltTransformContextPtr ctxt, request_rec *r,
+                        const char *id)
+{
+    transform_fragment *frag;
+    int hit = 0;
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(fragment_lock);
+#endif
+    frag = apr_hash_get(fragments, id, APR_HASH_KEY_STRING);
+    if (frag && frag->expires > apr_time_now()
+        && fragment_current(r, frag->reads)) {
+        fragment_copy(ctxt, xmlDocGetRootElement(frag->doc));
+        fragment_replay(r, frag->reads);
+        hit = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(fragment_lock);
+#endif
+    return hit;
+}
+
+/* Keep a fragment in memory, which takes doc over */
+static void fragment_keep(const char *id, xmlDocPtr doc, apr_time_t expires,
+                          apr_array_header_t *reads, apr_size_t size)
+{
+    transform_fragment *frag;
+    apr_hash_index_t *hi;
+    apr_time_t now = apr_time_now();
+    apr_pool_t *pool;
+    int i;
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(fragment_lock);
+#endif
+    if ((frag = apr_hash_get(fragments, id, APR_HASH_KEY_STRING)))
+        fragment_free(frag);
+    if (apr_hash_count(fragments) >= FRAGMENT_MAX
+        || fragment_bytes + size > FRAGMENT_MAX_BYTES) {
+        for (hi = apr_hash_first(NULL, fragments); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, (void **) &frag);
+            if (frag->expires <= now)
+                fragment_free(frag);
+        }
+    }
+    if (apr_hash_count(fragments) >= FRAGMENT_MAX
+        || fragment_bytes + size > FRAGMENT_MAX_BYTES
+        || apr_pool_create(&pool, fragment_pool) != APR_SUCCESS) {
+        xmlFreeDoc(doc);
+    }
+    else {
+        frag = apr_palloc(pool, sizeof(*frag));
+        frag->pool = pool;
+        frag->id = apr_pstrdup(pool, id);
+        frag->doc = doc;
+        frag->expires = expires;
+        frag->reads = apr_array_make(pool, reads->nelts, sizeof(const char *));
+        for (i = 0; i < reads->nelts; i++)
+            APR_ARRAY_PUSH(frag->reads, const char *) =
+                apr_pstrdup(pool, APR_ARRAY_IDX(reads, i, const char *));
+        frag->size = size;
+        apr_hash_set(fragments, frag->id, APR_HASH_KEY_STRING, frag);
+        fragment_bytes += size;
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(fragment_lock);
+#endif
+}
+
+/**
+ * A shared fragment file is the expiry time and the reads, a line each,
+ * an empty line, and the serialized root element.
+ */
+static const char *fragment_path(request_rec *r, const char *dir,
+                                 const char *id)
+{
+    return apr_pstrcat(r->pool, dir, "/", apr_pstrndup(r->pool, id, 2), "/",
+                       id, ".fragment", NULL);
+}
+
+static xmlDocPtr fragment_load(request_rec *r, const char *path,
+                               apr_time_t *expires,
+                               apr_array_header_t **reads,
+                               apr_size_t *size)
+{
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_size_t len;
+    char *data;
+    char *line;
+    char *end;
+
+    if (apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT,
+                      r->pool) != APR_SUCCESS)
+        return NULL;
+    if (apr_file_info_get(&finfo, APR_FINFO_SIZE, file) != APR_SUCCESS
+        || finfo.size > FRAGMENT_MAX_BYTES) {
+        apr_file_close(file);
+        return NULL;
+    }
+    len = (apr_size_t) finfo.size;
+    data = apr_palloc(r->pool, len + 1);
+    if (apr_file_read_full(file, data, len, NULL) != APR_SUCCESS) {
+        apr_file_close(file);
+        return NULL;
+    }
+    apr_file_close(file);
+    data[len] = '\0';
+
+    *expires = apr_strtoi64(data, &line, 10);
+    if (*line++ != '\n' || *expires <= apr_time_now())
+        return NULL;
+    *reads = apr_array_make(r->pool, 4, sizeof(const char *));
+    while (*line && *line != '\n') {
+        if (!(end = strchr(line, '\n')))
+            return NULL;
+        APR_ARRAY_PUSH(*reads, const char *) =
+            apr_pstrndup(r->pool, line, end - line);
+        line = end + 1;
+    }
+    if (!*line++ || !fragment_current(r, *reads))
+        return NULL;
+    *size = len - (line - data);
+    return xmlReadMemory(line, *size, NULL, NULL,
+                         XML_PARSE_NONET | XML_PARSE_NODICT);
+}
+
+static void fragment_save(request_rec *r, const char *path,
+                          apr_time_t expires, apr_array_header_t *reads,
+                          const xmlChar *body, apr_size_t len)
+{
+    apr_file_t *file;
+    apr_status_t rv;
+    char *tmp;
+    const char *head;
+
+    apr_dir_make(ap_make_dirstr_parent(r->pool, path), APR_OS_DEFAULT,
+                 r->pool);
+    tmp = apr_pstrcat(r->pool, path, ".XXXXXX", NULL);
+    if (apr_file_mktemp(&file, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+                        | APR_BUFFERED | APR_BINARY, r->pool)
+        != APR_SUCCESS)
+        return;
+    head = apr_psprintf(r->pool, "%" APR_INT64_T_FMT "\n%s%s\n",
+                        (apr_int64_t) expires,
+                        apr_array_pstrcat(r->pool, reads, '\n'),
+                        reads->nelts ? "\n" : "");
+    rv = apr_file_write_full(file, head, strlen(head), NULL);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_write_full(file, body, len, NULL);
+    if (apr_file_close(file) != APR_SUCCESS || rv != APR_SUCCESS
+        || apr_file_rename(tmp, path, r->pool) != APR_SUCCESS)
+        apr_file_remove(tmp, r->pool);
+}
+
+/**
+ * Run the body into a detached element, with the request's record of
+ * what was read set aside, so what the body read can be kept with it.
+ * Returns a document holding a copy of the nodes, or NULL when they
+ * can't be cached.
+ */
+static xmlDocPtr fragment_evaluate(xsltTransformContextPtr ctxt,
+                                   request_rec *r, xmlNodePtr node,
+                                   xmlNodePtr inst,
+                                   apr_array_header_t **reads)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    apr_array_header_t *uses = notes->uses;
+    apr_array_header_t *deps = notes->deps;
+    int uncacheable = notes->uncacheable;
+    xmlNodePtr insert = ctxt->insert;
+    xmlNodePtr holder;
+    xmlAttrPtr attr;
+    xmlDocPtr doc = NULL;
+    apr_finfo_t finfo;
+    int i;
+
+    holder = xmlNewDocNode(ctxt->output, NULL, BAD_CAST "fragment", NULL);
+    if (!holder) {
+        xsltApplyOneTemplate(ctxt, node, inst->children, NULL, NULL);
+        return NULL;
+    }
+
+    notes->uses = NULL;
+    notes->deps = NULL;
+    notes->uncacheable = 0;
+    ctxt->insert = holder;
+    xsltApplyOneTemplate(ctxt, node, inst->children, NULL, NULL);
+    ctxt->insert = insert;
+
+    *reads = apr_array_make(r->pool, 4, sizeof(const char *));
+    for (i = 0; notes->uses && i < notes->uses->nelts; i++)
+        APR_ARRAY_PUSH(*reads, const char *) =
+            APR_ARRAY_IDX(notes->uses, i, const char *);
+    for (i = 0; notes->deps && i < notes->deps->nelts; i++) {
+        const char *path = APR_ARRAY_IDX(notes->deps, i, const char *);
+        if (path && apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE
+                             | APR_FINFO_INODE, r->pool) == APR_SUCCESS)
+            APR_ARRAY_PUSH(*reads, const char *) =
+                apr_psprintf(r->pool, "F%" APR_INT64_T_FMT " %"
+                             APR_INT64_T_FMT " %" APR_INT64_T_FMT " %s",
+                             (apr_int64_t) finfo.mtime,
+                             (apr_int64_t) finfo.inode,
+                             (apr_int64_t) finfo.size, path);
+        else
+            APR_ARRAY_PUSH(*reads, const char *) = "N";
+    }
+    if (notes->uncacheable)
+        APR_ARRAY_PUSH(*reads, const char *) = "U";
+
+    notes->uses = uses;
+    notes->deps = deps;
+    notes->uncacheable = uncacheable;
+    fragment_replay(r, *reads);
+
+    /* Attributes belong to the element around us, which isn't cached */
+    for (attr = holder->properties; attr; attr = attr->next)
+        xmlAddChild(insert, (xmlNodePtr) xmlCopyProp(insert, attr));
+    fragment_copy(ctxt, holder);
+
+    if (ctxt->state == XSLT_STATE_OK && !holder->properties
+        && (doc = xmlNewDoc(BAD_CAST "1.0")))
+        xmlDocSetRootElement(doc, xmlDocCopyNode(holder, doc, 1));
+    xmlFreeNode(holder);
+    return doc;
+}
+
+static void transform_fragment_element(xsltTransformContextPtr ctxt,
+                                       xmlNodePtr node, xmlNodePtr inst,
+                                       xsltElemPreCompPtr comp)
+{
+    request_rec *r = ctxt->xpathCtxt ? ctxt->xpathCtxt->userData : NULL;
+    dir_cfg *dconf;
+    xmlChar *key = NULL;
+    xmlChar *ttl = NULL;
+    xmlChar *shared;
+    xmlBufferPtr buf;
+    xmlDocPtr doc;
+    apr_array_header_t *reads;
+    apr_time_t expires;
+    apr_size_t size;
+    const char *id;
+    const char *path = NULL;
+    char *end = NULL;
+    long seconds = 0;
+
+    if (!ctxt->insert || !inst)
+        return;
+    if (r) {
+        key = xsltEvalAttrValueTemplate(ctxt, inst, BAD_CAST "key", NULL);
+        ttl = xsltEvalAttrValueTemplate(ctxt, inst, BAD_CAST "ttl", NULL);
+        if (ttl)
+            seconds = strtol((const char *) ttl, &end, 10);
+    }
+    if (!r || !key || !ttl || *end || seconds <= 0) {
+        if (r)
+            xsltTransformError(ctxt, NULL, inst,
+                               "apache:cache needs a key and a ttl in "
+                               "seconds, not caching\n");
+        xsltApplyOneTemplate(ctxt, node, inst->children, NULL, NULL);
+        goto done;
+    }
+
+    id = fragment_id(r, inst, key);
+    if (fragment_hit(ctxt, r, id))
+        goto done;
+
+    dconf = ap_get_module_config(r->per_dir_config, &transform_module);
+    shared = xmlGetProp(inst, BAD_CAST "shared");
+    if (shared && xmlStrEqual(shared, BAD_CAST "yes") && dconf->output_cache)
+        path = fragment_path(r, dconf->output_cache, id);
+    xmlFree(shared);
+
+    /* Another child may have made it */
+    if (path && (doc = fragment_load(r, path, &expires, &reads, &size))) {
+        fragment_copy(ctxt, xmlDocGetRootElement(doc));
+        fragment_replay(r, reads);
+        fragment_keep(id, doc, expires, reads, size);
+        goto done;
+    }
+
+    if (!(doc = fragment_evaluate(ctxt, r, node, inst, &reads)))
+        goto done;
+    expires = apr_time_now() + apr_time_from_sec(seconds);
+    buf = xmlBufferCreate();
+    if (!buf || xmlNodeDump(buf, doc, xmlDocGetRootElement(doc), 0, 0) < 0) {
+        xmlFreeDoc(doc);
+    }
+    else {
+        if (path)
+            fragment_save(r, path, expires, reads, xmlBufferContent(buf),
+                          xmlBufferLength(buf));
+        fragment_keep(id, doc, expires, reads, xmlBufferLength(buf));
+    }
+    if (buf)
+        xmlBufferFree(buf);
+
+  done:
+    xmlFree(key);
+    xmlFree(ttl);
+}
+
+apr_status_t transform_fragment_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_pool_create(&fragment_pool, p);
+    fragments = apr_hash_make(fragment_pool);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_create(&fragment_lock, p);
+#endif
+    xsltRegisterExtModuleElement((const xmlChar *) "cache",
+                                 TRANSFORM_APACHE_NAMESPACE, NULL,
+                                 transform_fragment_element);
+    return APR_SUCCESS;
+}
+
+/* vim:ai:et:ts=4:nowrap
+ */
@@ -0,0 +1,747 @@
+/**
+ *    Copyright (c) 2002 WebThing Ltd
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *    Authors:    Nick Kew <nick webthing.com>
+ *                Edward Rudd <urkle at outoforder dot com>
+ *                Paul Querna <chip at outoforder dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Parsed Input Caching
+ *
+ * With TransformOptions CacheInput, the document parsed from a static
+ * file, with its XIncludes processed, is kept by each child and used
+ * again until the file or anything it included changes.  Responses that
+ * can't be cached as a whole at least skip parsing that way.
+ *
+ * libxslt writes to the source document while transforming (node order,
+ * key and ID flags, stripped whitespace), so two transforms can't share
+ * one.  The document parsed first is kept aside and only ever copied;
+ * requests check out copies, which go back on a short spare list when
+ * the transform left them as they were, so a busy page is usually
+ * transformed without parsing or copying at all.
+ *
+ * With TransformOptions CacheDocuments, what document() loads is kept in
+ * the same table, keyed by the URI as the request resolves it, until a
+ * file it was read from changes.  libxslt frees the documents it loads
+ * and may strip them, so each transform gets its own copy, which still
+ * saves the subrequest and the parse.
+ *
+ * For pure stylesheets, those documents are also kept after a transform
+ * together with the key tables it built over them, and handed to the next
+ * transforms with the same stylesheet as if they had loaded them already.
+ * Nothing writes to a document and its keys once every xsl:key has been
+ * computed over it, so these are shared rather than copied, and key()
+ * over a big catalog costs a hash lookup instead of an index build.
+ */
+
+#include "mod_transform_private.h"
+
+#include <libxslt/documents.h>
+#include <libxslt/imports.h>
+#include <libxslt/keys.h>
+
+/* Copies of one document kept for reuse */
+#define INPUT_SPARE_MAX 8
+/* A parsed document takes a few times the size of its text */
+#define INPUT_SIZE_FACTOR 4
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *input_lock;
+#endif
+static apr_pool_t *input_pool;
+static apr_hash_t *inputs;
+static apr_size_t input_bytes;
+static apr_off_t input_max_bytes;
+static xsltDocLoaderFunc default_loader;
+static apr_hash_t *memos;       /* lists of documents by stylesheet */
+
+/* A document the loader handed to a transform, see transform_input_finish */
+typedef struct
+{
+    xmlDocPtr doc;
+    const char *key;
+    apr_array_header_t *files;
+    apr_size_t bytes;
+}
+transform_loaded;
+
+static const char *input_key(request_rec *r, dir_cfg *dconf)
+{
+    /* With ApacheFS, XIncludes resolve through the host's configuration */
+    return apr_psprintf(r->pool, "input:%s:%d:%s",
+                        r->server->server_hostname
+                        ? r->server->server_hostname : "",
+                        (int) (dconf->opts & (XINCLUDES | USE_APACHE_FS)),
+                        r->filename);
+}
+
+/* Whether every file an entry was read from is still what it was */
+static int input_current(request_rec *r, transform_input * input)
+{
+    transform_xslt_dep *dep = (transform_xslt_dep *) input->deps->elts;
+    apr_finfo_t finfo;
+    int i;
+
+    for (i = 0; i < input->deps->nelts; i++, dep++) {
+        if (apr_stat(&finfo, dep->path, APR_FINFO_MTIME | APR_FINFO_SIZE
+                     | APR_FINFO_INODE, r->pool) != APR_SUCCESS
+            || finfo.mtime != dep->mtime || finfo.inode != dep->inode
+            || finfo.size != dep->size)
+            return 0;
+    }
+    return 1;
+}
+
+/* The documents kept for a stylesheet are listed under its entry */
+static void memo_link(transform_input * memo)
+{
+    transform_input *head = apr_hash_get(memos, &memo->xslt,
+                                         sizeof(memo->xslt));
+
+    /* The table keeps the key pointer it was given, which is the head's */
+    if (head)
+        apr_hash_set(memos, &head->xslt, sizeof(head->xslt), NULL);
+    memo->next = head;
+    apr_hash_set(memos, &memo->xslt, sizeof(memo->xslt), memo);
+}
+
+static void memo_unlink(transform_input * memo)
+{
+    transform_input *prev = apr_hash_get(memos, &memo->xslt,
+                                         sizeof(memo->xslt));
+
+    if (prev == memo) {
+        apr_hash_set(memos, &memo->xslt, sizeof(memo->xslt), NULL);
+        if (memo->next)
+            apr_hash_set(memos, &memo->next->xslt, sizeof(memo->xslt),
+                         memo->next);
+        return;
+    }
+    while (prev && prev->next != memo)
+        prev = prev->next;
+    if (prev)
+        prev->next = memo->next;
+}
+
+static void memo_free_keys(void *keys)
+{
+    xsltDocument holder;
+
+    memset(&holder, 0, sizeof(holder));
+    holder.keys = keys;
+    xsltFreeDocumentKeys(&holder);
+}
+
+/* Take an entry out of the table; it is freed once the last copy is back */
+static void input_remove(transform_input * input)
+{
+    int i;
+
+    if (!input->gone) {
+        apr_hash_set(inputs, input->key, APR_HASH_KEY_STRING, NULL);
+        if (input->xslt)
+            memo_unlink(input);
+        input_bytes -= input->bytes * (1 + input->spare->nelts);
+        input->gone = 1;
+    }
+    for (i = 0; i < input->spare->nelts; i++)
+        xmlFreeDoc(APR_ARRAY_IDX(input->spare, i, xmlDocPtr));
+    input->spare->nelts = 0;
+    if (!input->busy) {
+        if (input->keys)
+            memo_free_keys(input->keys);
+        xmlFreeDoc(input->doc);
+        if (input->xslt)
+            transform_cache_release(input->xslt);
+        apr_pool_destroy(input->pool);
+    }
+}
+
+/* Make room for bytes more, dropping the least recently used first */
+static int input_room(apr_size_t bytes)
+{
+    apr_hash_index_t *hi;
+    transform_input *input;
+    transform_input *oldest;
+
+    if (!input_max_bytes)
+        return 1;
+    if (bytes > (apr_size_t) input_max_bytes)
+        return 0;
+    while (input_bytes + bytes > (apr_size_t) input_max_bytes) {
+        oldest = NULL;
+        for (hi = apr_hash_first(NULL, inputs); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, (void **) &input);
+            if (!oldest || input->used < oldest->used)
+                oldest = input;
+        }
+        if (!oldest)
+            return 0;
+        input_remove(oldest);
+    }
+    return 1;
+}
+
+/* Find an entry, and hold on to it */
+static transform_input *input_get(const char *key)
+{
+    transform_input *found;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    if ((found = apr_hash_get(inputs, key, APR_HASH_KEY_STRING))) {
+        found->busy++;
+        found->used = apr_time_now();
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+    return found;
+}
+
+/* Let go of an entry that turned out to be stale */
+static void input_drop(transform_input * input)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    input->busy--;
+    input_remove(input);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+}
+
+/* Put back what the request read before, followed by what read adds */
+static void input_read(transform_notes * notes, apr_array_header_t *deps,
+                       apr_array_header_t *read)
+{
+    notes->deps = deps;
+    if (read) {
+        if (deps)
+            apr_array_cat(deps, read);
+        else
+            notes->deps = read;
+    }
+}
+
+/**
+ * The identity of the files in read, and their total size in *bytes.
+ * NULL if anything in it isn't a file.
+ */
+static apr_array_header_t *input_files(request_rec *r,
+                                       apr_array_header_t *read,
+                                       apr_size_t *bytes)
+{
+    apr_array_header_t *files;
+    transform_xslt_dep *dep;
+    apr_finfo_t finfo;
+    int i;
+
+    files = apr_array_make(r->pool, read ? read->nelts : 0,
+                           sizeof(transform_xslt_dep));
+    for (i = 0; read && i < read->nelts; i++) {
+        const char *path = APR_ARRAY_IDX(read, i, const char *);
+
+        if (!path || apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_SIZE
+                              | APR_FINFO_INODE, r->pool) != APR_SUCCESS)
+            return NULL;
+        dep = apr_array_push(files);
+        dep->path = path;
+        dep->mtime = finfo.mtime;
+        dep->inode = finfo.inode;
+        dep->size = finfo.size;
+        *bytes += (apr_size_t) finfo.size;
+    }
+    return files;
+}
+
+/**
+ * Add an entry for master, replacing any under the same key.  It takes
+ * master over, and for a stylesheet's document the keys and a reference
+ * to the stylesheet, unless it returns NULL for lack of room.
+ */
+static transform_input *input_keep(request_rec *r, const char *key,
+                                   xmlDocPtr master,
+                                   apr_array_header_t *files,
+                                   apr_size_t bytes, int busy,
+                                   transform_xslt_entry * xslt, void *keys,
+                                   int nbkeys)
+{
+    transform_input *entry = NULL;
+    transform_input *old;
+    apr_pool_t *pool;
+    int i;
+
+    bytes *= INPUT_SIZE_FACTOR;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    if ((old = apr_hash_get(inputs, key, APR_HASH_KEY_STRING)))
+        input_remove(old);
+    if (input_room(bytes)
+        && apr_pool_create(&pool, input_pool) == APR_SUCCESS) {
+        entry = apr_pcalloc(pool, sizeof(*entry));
+        entry->pool = pool;
+        entry->key = apr_pstrdup(pool, key);
+        entry->doc = master;
+        entry->mtime = r->finfo.mtime;
+        entry->inode = r->finfo.inode;
+        entry->size = r->finfo.size;
+        entry->deps = apr_array_copy(pool, files);
+        for (i = 0; i < entry->deps->nelts; i++)
+            APR_ARRAY_IDX(entry->deps, i, transform_xslt_dep).path =
+                apr_pstrdup(pool, APR_ARRAY_IDX(files, i,
+                                                transform_xslt_dep).path);
+        entry->spare = apr_array_make(pool, INPUT_SPARE_MAX,
+                                      sizeof(xmlDocPtr));
+        entry->bytes = bytes;
+        entry->used = apr_time_now();
+        entry->busy = busy;
+        apr_hash_set(inputs, entry->key, APR_HASH_KEY_STRING, entry);
+        input_bytes += bytes;
+        if (xslt) {
+            apr_atomic_inc32(&xslt->refcount);
+            entry->xslt = xslt;
+            entry->keys = keys;
+            entry->nbkeys = nbkeys;
+            memo_link(entry);
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+    return entry;
+}
+
+/**
+ * Called on the first brigade.  Returns whether the input is a static
+ * file that may be cached, with *doc and *input set when a copy of it
+ * was found.
+ */
+int transform_input_lookup(ap_filter_t * f, apr_bucket_brigade * bb,
+                           xmlDocPtr * doc, transform_input ** input)
+{
+    request_rec *r = f->r;
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    transform_input *found;
+    transform_xslt_dep *dep;
+    xmlDocPtr *popped;
+    xmlDocPtr spare = NULL;
+    int i;
+
+    *doc = NULL;
+    *input = NULL;
+
+    /* The handler has to be sending the file itself */
+    if (!(dconf->opts & CACHE_INPUT) || !notes || notes->document
+        || r->finfo.filetype != APR_REG || APR_BRIGADE_EMPTY(bb)
+        || !APR_BUCKET_IS_FILE(APR_BRIGADE_FIRST(bb)))
+        return 0;
+
+    if (!(found = input_get(input_key(r, dconf))))
+        return 1;
+    if (r->finfo.mtime != found->mtime || r->finfo.inode != found->inode
+        || r->finfo.size != found->size || !input_current(r, found)) {
+        input_drop(found);
+        return 1;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    if (!found->gone && (popped = apr_array_pop(found->spare))) {
+        spare = *popped;
+        input_bytes -= found->bytes;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+
+    if (!(*doc = spare ? spare : xmlCopyDoc(found->doc, 1))) {
+        transform_input_release(found, NULL, 0);
+        return 1;
+    }
+    *input = found;
+
+    /* As if the XIncludes had been processed for this request */
+    dep = (transform_xslt_dep *) found->deps->elts;
+    for (i = 0; i < found->deps->nelts; i++, dep++)
+        transform_add_dep(r, dep->path);
+    return 1;
+}
+
+/**
+ * Process the XIncludes of a freshly parsed document, and keep a copy of
+ * the result when the input may be cached and it only included files.
+ * input may be NULL when it may not.
+ */
+void transform_input_include(ap_filter_t * f, xmlDocPtr doc, int cacheable,
+                             transform_input ** input)
+{
+    request_rec *r = f->r;
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    apr_array_header_t *deps = notes->deps;
+    apr_array_header_t *read;
+    apr_array_header_t *files;
+    apr_size_t bytes = (apr_size_t) r->finfo.size;
+    xmlDocPtr master;
+    int failed = 0;
+
+    if (input)
+        *input = NULL;
+
+    /* Set aside what was read so far, to see what the XIncludes read */
+    notes->deps = NULL;
+    if (dconf->opts & XINCLUDES)
+        failed = xmlXIncludeProcessFlags(doc,
+                                         XML_PARSE_RECOVER |
+                                         XML_PARSE_XINCLUDE |
+                                         XML_PARSE_NONET |
+                                         XSLT_PARSE_OPTIONS) < 0;
+    read = notes->deps;
+    input_read(notes, deps, read);
+
+    if (!cacheable || !input || failed || !(files = input_files(r, read, &bytes))
+        || !(master = xmlCopyDoc(doc, 1)))
+        return;
+    if (!(*input = input_keep(r, input_key(r, dconf), master, files, bytes,
+                              1, NULL, NULL, 0)))
+        xmlFreeDoc(master);
+}
+
+static const char *document_key(request_rec *r, dir_cfg *dconf,
+                                const xmlChar *URI, int options)
+{
+    apr_uri_t uri;
+    const char *base = "";
+
+    /* Relative references resolve against the file, or with ApacheFS the URI */
+    if (apr_uri_parse(r->pool, (const char *) URI, &uri) != APR_SUCCESS
+        || (!uri.scheme && (!uri.path || *uri.path != '/')))
+        base = apr_pstrcat(r->pool, ap_make_dirstr_parent(r->pool,
+                                                          r->filename),
+                           " ", ap_make_dirstr_parent(r->pool, r->uri),
+                           " ", NULL);
+    return apr_psprintf(r->pool, "document:%s:%d:%d:%s%s",
+                        r->server->server_hostname
+                        ? r->server->server_hostname : "",
+                        (int) (dconf->opts & USE_APACHE_FS), options, base,
+                        (const char *) URI);
+}
+
+/* Remember what was handed to a transform, for transform_input_finish */
+static void document_loaded(request_rec *r, transform_notes * notes,
+                            xmlDocPtr doc, const char *key,
+                            apr_array_header_t *files, apr_size_t bytes)
+{
+    transform_loaded *loaded;
+
+    if (!notes->loaded)
+        notes->loaded = apr_array_make(r->pool, 4, sizeof(transform_loaded));
+    loaded = apr_array_push(notes->loaded);
+    loaded->doc = doc;
+    loaded->key = key;
+    loaded->files = files;
+    loaded->bytes = bytes;
+}
+
+/* Installed as libxslt's document loader */
+static xmlDocPtr transform_document_loader(const xmlChar *URI,
+                                           xmlDictPtr dict, int options,
+                                           void *ctxt, xsltLoadType type)
+{
+    xsltTransformContextPtr tctxt = ctxt;
+    request_rec *r = NULL;
+    transform_notes *notes = NULL;
+    dir_cfg *dconf = NULL;
+    transform_input *found;
+    transform_xslt_dep *dep;
+    apr_array_header_t *deps;
+    apr_array_header_t *read;
+    apr_array_header_t *files;
+    apr_size_t bytes = 0;
+    const char *key;
+    xmlDocPtr doc;
+    xmlDocPtr copy;
+    int i;
+
+    if (type == XSLT_LOAD_DOCUMENT && tctxt && tctxt->xpathCtxt)
+        r = tctxt->xpathCtxt->userData;
+    if (r) {
+        notes = ap_get_module_config(r->request_config, &transform_module);
+        dconf = ap_get_module_config(r->per_dir_config, &transform_module);
+    }
+    if (!r || !notes || !URI || !(dconf->opts & CACHE_DOCUMENTS))
+        return default_loader(URI, dict, options, ctxt, type);
+
+    key = document_key(r, dconf, URI, options);
+    if ((found = input_get(key))) {
+        if (!input_current(r, found)) {
+            input_drop(found);
+        }
+        else {
+            if ((copy = xmlCopyDoc(found->doc, 1))) {
+                files = apr_array_copy(r->pool, found->deps);
+                dep = (transform_xslt_dep *) files->elts;
+                for (i = 0; i < files->nelts; i++, dep++) {
+                    dep->path = apr_pstrdup(r->pool, dep->path);
+                    transform_add_dep(r, dep->path);
+                }
+                document_loaded(r, notes, copy, key, files,
+                                found->bytes / INPUT_SIZE_FACTOR);
+            }
+            transform_input_release(found, NULL, 0);
+            if (copy)
+                return copy;
+        }
+    }
+
+    /**
+     * Load it with a dictionary of its own, so copies can be made of it
+     * while this transform is long gone, and see what files it came from.
+     */
+    deps = notes->deps;
+    notes->deps = NULL;
+    doc = default_loader(URI, NULL, options, ctxt, type);
+    read = notes->deps;
+    input_read(notes, deps, read);
+
+    if (!doc || !read || !(files = input_files(r, read, &bytes))
+        || !(copy = xmlCopyDoc(doc, 1)))
+        return doc;
+    if (!input_keep(r, key, doc, files, bytes, 0, NULL, NULL, 0))
+        xmlFreeDoc(doc);
+    document_loaded(r, notes, copy, key, files, bytes);
+    return copy;
+}
+
+/* Whether the keys of a stylesheet can't depend on anything but the document */
+static int keys_static(xsltStylesheetPtr style)
+{
+    xsltKeyDefPtr keyd;
+
+    for (; style; style = xsltNextImport(style)) {
+        for (keyd = style->keys; keyd; keyd = keyd->next) {
+            if ((keyd->match && xmlStrchr(keyd->match, '$'))
+                || (keyd->use && xmlStrchr(keyd->use, '$')))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Hand the documents kept for a stylesheet, and their keys, to a new
+ * transform as if it had loaded them itself.  Returns what it has to give
+ * back to transform_input_finish.
+ */
+apr_array_header_t *transform_input_attach(request_rec *r,
+                                           xsltTransformContextPtr tcontext,
+                                           transform_xslt_entry * entry)
+{
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    apr_array_header_t *found;
+    apr_array_header_t *attached;
+    transform_input *memo;
+    transform_xslt_dep *dep;
+    xsltDocumentPtr docu;
+    const char *prefix;
+    int i;
+    int j;
+
+    if (!entry || !entry->pure || !(dconf->opts & CACHE_DOCUMENTS))
+        return NULL;
+
+    found = apr_array_make(r->pool, 4, sizeof(transform_input *));
+    prefix = apr_psprintf(r->pool, "memo:%pp:", entry);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    for (memo = apr_hash_get(memos, &entry, sizeof(entry)); memo;
+         memo = memo->next) {
+        /* Relative URIs only name the same document for the same request */
+        if (memo->doc->URL
+            && !strcmp(memo->key, apr_pstrcat(r->pool, prefix,
+                                              document_key(r, dconf,
+                                                           memo->doc->URL,
+                                                           tcontext->
+                                                           parserOptions),
+                                              NULL))) {
+            memo->busy++;
+            memo->used = apr_time_now();
+            APR_ARRAY_PUSH(found, transform_input *) = memo;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+
+    attached = apr_array_make(r->pool, found->nelts,
+                              sizeof(transform_input *));
+    for (i = 0; i < found->nelts; i++) {
+        memo = APR_ARRAY_IDX(found, i, transform_input *);
+        if (!input_current(r, memo)) {
+            input_drop(memo);
+            continue;
+        }
+        if (!(docu = xsltNewDocument(tcontext, memo->doc))) {
+            transform_input_release(memo, NULL, 0);
+            continue;
+        }
+        /* Neither is libxslt's to free */
+        docu->main = 1;
+        docu->keys = memo->keys;
+        docu->nbKeysComputed = memo->nbkeys;
+        dep = (transform_xslt_dep *) memo->deps->elts;
+        for (j = 0; j < memo->deps->nelts; j++, dep++)
+            transform_add_dep(r, dep->path);
+        APR_ARRAY_PUSH(attached, transform_input *) = memo;
+    }
+    return attached;
+}
+
+/**
+ * Free a transform context, taking back the documents attached to it,
+ * and keeping those it loaded whose keys were all built, when it ran to
+ * the end.
+ */
+void transform_input_finish(request_rec *r, xsltTransformContextPtr tcontext,
+                            transform_xslt_entry * entry,
+                            apr_array_header_t *attached, int ok)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    apr_array_header_t *adopted = NULL;
+    apr_array_header_t *loads = notes ? notes->loaded : NULL;
+    transform_loaded *loaded;
+    transform_input *memo;
+    xsltDocumentPtr docu;
+    int i;
+
+    if (ok && attached && loads && keys_static(entry->transform))
+        adopted = apr_array_make(r->pool, loads->nelts,
+                                 sizeof(xsltDocument));
+
+    for (docu = tcontext->docList; docu; docu = docu->next) {
+        for (i = 0; attached && i < attached->nelts; i++) {
+            memo = APR_ARRAY_IDX(attached, i, transform_input *);
+            if (docu->main && docu->doc == memo->doc)
+                docu->keys = NULL;
+        }
+        if (!adopted || docu->main
+            || docu->nbKeysComputed != tcontext->nbKeys)
+            continue;
+        loaded = (transform_loaded *) loads->elts;
+        for (i = 0; i < loads->nelts; i++, loaded++) {
+            if (loaded->doc == docu->doc) {
+                *(xsltDocument *) apr_array_push(adopted) = *docu;
+                docu->main = 1;
+                docu->keys = NULL;
+                break;
+            }
+        }
+    }
+    xsltFreeTransformContext(tcontext);
+    /* The rest went with the context; what was adopted is still in loads */
+    if (notes)
+        notes->loaded = NULL;
+
+    for (i = 0; attached && i < attached->nelts; i++)
+        transform_input_release(APR_ARRAY_IDX(attached, i,
+                                              transform_input *), NULL, 0);
+
+    for (i = 0; adopted && i < adopted->nelts; i++) {
+        xsltDocument *taken = &APR_ARRAY_IDX(adopted, i, xsltDocument);
+        int j;
+
+        loaded = (transform_loaded *) loads->elts;
+        for (j = 0; loaded[j].doc != taken->doc; j++);
+        if (!input_keep(r, apr_psprintf(r->pool, "memo:%pp:%s", entry,
+                                        loaded[j].key), taken->doc,
+                        loaded[j].files, loaded[j].bytes, 0, entry,
+                        taken->keys, taken->nbKeysComputed)) {
+            if (taken->keys)
+                memo_free_keys(taken->keys);
+            xmlFreeDoc(taken->doc);
+        }
+    }
+}
+
+/**
+ * Done with a document.  One that came from the cache goes back on the
+ * spare list if the transform didn't change it; anything else is freed.
+ */
+void transform_input_release(transform_input * input, xmlDocPtr doc,
+                             int reusable)
+{
+    if (!input) {
+        if (doc)
+            xmlFreeDoc(doc);
+        return;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(input_lock);
+#endif
+    input->busy--;
+    if (doc && reusable && !input->gone
+        && input->spare->nelts < INPUT_SPARE_MAX
+        && (!input_max_bytes || input_bytes + input->bytes
+            <= (apr_size_t) input_max_bytes)) {
+        APR_ARRAY_PUSH(input->spare, xmlDocPtr) = doc;
+        input_bytes += input->bytes;
+        doc = NULL;
+    }
+    if (input->gone && !input->busy)
+        input_remove(input);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(input_lock);
+#endif
+    if (doc)
+        xmlFreeDoc(doc);
+}
+
+apr_status_t transform_input_child_init(apr_pool_t *p, server_rec *s)
+{
+    svr_cfg *sconf = ap_get_module_config(s->module_config,
+                                          &transform_module);
+
+    input_max_bytes = sconf->input_max_bytes;
+    apr_pool_create(&input_pool, p);
+    default_loader = xsltDocDefaultLoader;
+    xsltSetLoaderFunc(transform_document_loader);
+    inputs = apr_hash_make(input_pool);
+    memos = apr_hash_make(input_pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&input_lock, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    return APR_SUCCESS;
+}
+
+/* vim:ai:et:ts=4:nowrap
+ */
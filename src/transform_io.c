@@ -30,6 +30,109 @@
 #endif
 #include "mod_transform_private.h"
 
+#include <stdlib.h>
+
+/**
+ * Output buffers
+ *
+ * The serializer's output is copied once, from libxml's buffer into one
+ * of ours, which then goes down the chain as a heap bucket as it is; no
+ * brigade writes, and no 8K buckets.  The first buffer of a response is
+ * sized from the average output of its stylesheet, the rest are
+ * TRANSFORM_OUTPUT_CHUNK bytes and go back to a list for reuse once the
+ * core is done with them.  Buckets can be destroyed on any thread, so the
+ * list belongs to the child and is locked.  Output is never converted:
+ * the buffer libxslt serializes into has no encoder.
+ */
+#define OUTPUT_MIN_SIZE 8192
+#define OUTPUT_FREE_MAX 64
+
+typedef struct output_buffer
+{
+    apr_size_t size;
+    /* data follows */
+}
+output_buffer;
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *output_lock;
+#endif
+static output_buffer *output_free[OUTPUT_FREE_MAX];
+static int output_nfree;
+
+static void output_buffer_free(void *data)
+{
+    output_buffer *b = (output_buffer *) data - 1;
+
+    if (b->size == TRANSFORM_OUTPUT_CHUNK) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(output_lock);
+#endif
+        if (output_nfree < OUTPUT_FREE_MAX) {
+            output_free[output_nfree++] = b;
+            b = NULL;
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(output_lock);
+#endif
+    }
+    free(b);
+}
+
+static char *output_buffer_get(apr_size_t size)
+{
+    output_buffer *b = NULL;
+
+    if (size == TRANSFORM_OUTPUT_CHUNK) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(output_lock);
+#endif
+        if (output_nfree)
+            b = output_free[--output_nfree];
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(output_lock);
+#endif
+    }
+    if (!b && (b = malloc(sizeof(output_buffer) + size)))
+        b->size = size;
+    return b ? (char *) (b + 1) : NULL;
+}
+
+/* Put what the buffer holds at the end of the brigade */
+static void output_bucket(transform_xmlio_output_ctx * octx)
+{
+    apr_bucket *b;
+
+    if (!octx->buf)
+        return;
+    if (octx->used) {
+        b = apr_bucket_heap_create(octx->buf, octx->used, output_buffer_free,
+                                   octx->bb->bucket_alloc);
+        APR_BRIGADE_INSERT_TAIL(octx->bb, b);
+    }
+    else {
+        output_buffer_free(octx->buf);
+    }
+    octx->buf = NULL;
+    octx->used = octx->size = 0;
+}
+
+static apr_status_t output_cleanup(void *data)
+{
+    while (output_nfree)
+        free(output_free[--output_nfree]);
+    return APR_SUCCESS;
+}
+
+apr_status_t transform_io_child_init(apr_pool_t *p, server_rec *s)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&output_lock, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    apr_pool_cleanup_register(p, NULL, output_cleanup, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+}
+
 static apr_status_t io_pass_failure(ap_filter_t * filter, const char *msg,
                                  transform_notes * notes)
 {
@@ -39,13 +142,81 @@ static apr_status_t io_pass_failure(ap_filter_t * filter, const char *msg,
 }
 
 
+/**
+ * Remember a file the response was built from.  NULL means something that
+ * isn't a file was read, so the response can't be validated by stat.
+ */
+void transform_add_dep(request_rec *r, const char *filename)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+#if HAVE_MOD_DEPENDS
+    if (filename)
+        depends_add_file(r, filename);
+#endif
+    if (!notes)
+        return;
+    if (!notes->deps)
+        notes->deps = apr_array_make(r->pool, 4, sizeof(const char *));
+    APR_ARRAY_PUSH(notes->deps, const char *) =
+        filename ? apr_pstrdup(r->pool, filename) : NULL;
+}
+
+/**
+ * Send what has been serialized so far.  The first part is flushed to get
+ * the client going; after that the network decides.
+ */
+static apr_status_t output_pass(transform_xmlio_output_ctx * octx)
+{
+    apr_status_t rv;
+
+    if (!octx->passed)
+        APR_BRIGADE_INSERT_TAIL(octx->bb,
+                                apr_bucket_flush_create(octx->bb->
+                                                        bucket_alloc));
+    octx->passed = 1;
+    octx->pending = 0;
+    rv = ap_pass_brigade(octx->next, octx->bb);
+    apr_brigade_cleanup(octx->bb);
+    return rv;
+}
+
 int transform_xmlio_output_write(void *context, const char *buffer,
                                         int len)
 {
-    if (len > 0) {
-        transform_xmlio_output_ctx *octx =
-            (transform_xmlio_output_ctx *) context;
-        ap_fwrite(octx->next, octx->bb, buffer, len);
+    transform_xmlio_output_ctx *octx = (transform_xmlio_output_ctx *) context;
+    const char *pos = buffer;
+    apr_size_t left = len > 0 ? len : 0;
+    apr_size_t n;
+
+    if (octx->spool && left)
+        transform_spool_write(octx->spool, buffer, left);
+    while (left) {
+        if (!octx->buf) {
+            /* Only the first buffer is sized after the expected output */
+            n = TRANSFORM_OUTPUT_CHUNK;
+            if (!octx->passed && !octx->pending && octx->hint) {
+                n = octx->hint + octx->hint / 4;
+                n = n < OUTPUT_MIN_SIZE ? OUTPUT_MIN_SIZE
+                    : n > TRANSFORM_OUTPUT_CHUNK ? TRANSFORM_OUTPUT_CHUNK : n;
+            }
+            if (!(octx->buf = output_buffer_get(n)))
+                return -1;
+            octx->size = n;
+        }
+        n = octx->size - octx->used < left ? octx->size - octx->used : left;
+        memcpy(octx->buf + octx->used, pos, n);
+        octx->used += n;
+        octx->pending += n;
+        pos += n;
+        left -= n;
+        if (octx->used == octx->size) {
+            output_bucket(octx);
+            /* Stops serializing once the client has gone */
+            if (octx->pending >= TRANSFORM_OUTPUT_CHUNK
+                && output_pass(octx) != APR_SUCCESS)
+                return -1;
+        }
     }
     return len;
 }
@@ -53,7 +224,10 @@ int transform_xmlio_output_write(void *context, const char *buffer,
 int transform_xmlio_output_close(void *context)
 {
     transform_xmlio_output_ctx *octx = (transform_xmlio_output_ctx *) context;
-    apr_bucket *b = apr_bucket_eos_create(octx->bb->bucket_alloc);
+    apr_bucket *b;
+
+    output_bucket(octx);
+    b = apr_bucket_eos_create(octx->bb->bucket_alloc);
     APR_BRIGADE_INSERT_TAIL(octx->bb, b);
     return 0;
 }
@@ -156,9 +330,10 @@ static const char *find_relative_uri(ap_filter_t * f, const char *orig_href)
                           &base_url);
             ex_apr_uri_resolve_relative(f->r->pool, &base_url, &url);
             href = apr_uri_unparse(f->r->pool, &url, 0);
-#if HAVE_MOD_DEPENDS
-            depends_add_file(f->r, url.path);
-#endif
+            if (!url.scheme || !strcasecmp(url.scheme, "file"))
+                transform_add_dep(f->r, url.path);
+            else
+                transform_add_dep(f->r, NULL);
             return href;
         }
     }
@@ -255,9 +430,12 @@ static xmlParserInputBufferPtr
 
     ap_add_output_filter(APACHEFS_FILTER_NAME,  input_ctx, input_ctx->rr, f->r->connection);
 
-#if HAVE_MOD_DEPENDS
-    depends_add_file(f->r, input_ctx->rr->filename);
-#endif
+    /* Only a file served as is can be checked later */
+    transform_add_dep(f->r, input_ctx->rr->finfo.filetype == APR_REG
+                      && (!input_ctx->rr->handler
+                          || !strcmp(input_ctx->rr->handler,
+                                     "default-handler"))
+                      ? input_ctx->rr->filename : NULL);
     rr_status = ap_run_sub_req(input_ctx->rr);
 
     if(rr_status != OK) {
@@ -306,9 +484,7 @@ xmlParserInputBufferPtr transform_get_input(const char *URI,
     if (dconf->opts & USE_APACHE_FS) {
         /* We want to use an Apache based Filesystem for Libxml. Let the fun begin. */
         if(strncmp(URI,"file:///etc/xml/catalog", sizeof("file:///etc/xml/catalog")) == 0){
-#if HAVE_MOD_DEPENDS
-            depends_add_file(f->r, "/etc/xml/catalog");
-#endif
+            transform_add_dep(f->r, "/etc/xml/catalog");
             return __xmlParserInputBufferCreateFilename(URI, enc);
         }
         else {
@@ -0,0 +1,1334 @@
+/**
+ *    Copyright (c) 2002 WebThing Ltd
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *    Authors:    Nick Kew <nick webthing.com>
+ *                Edward Rudd <urkle at outoforder dot com>
+ *                Paul Querna <chip at outoforder dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Transformed Output Caching
+ *
+ * With TransformOutputCache pointing at a directory, the serialized result
+ * of transforming a static file is spooled there and served to every
+ * child from then on, without parsing or transforming, until one of the
+ * files it was made from changes.
+ *
+ * A spool file is the body, followed by the content type and the identity
+ * (mtime, inode, size) of every dependency, followed by a fixed size
+ * footer giving the length of the body.  That way the body can be written
+ * while it is being serialized, and a hit can be sent as a FILE bucket.
+ * Files are written under a temporary name and renamed into place, so
+ * children never see half a spool file.
+ */
+
+#include "mod_transform_private.h"
+#include "apr_md5.h"
+#include "apr_file_io.h"
+#include "apr_lib.h"
+#include "apr_thread_cond.h"
+
+#include <stdlib.h>
+
+#if HAVE_ZLIB_H && HAVE_LIBZ
+#include <zlib.h>
+#endif
+#if HAVE_BROTLI_ENCODE_H && HAVE_LIBBROTLIENC
+#include <brotli/encode.h>
+#endif
+
+#define SPOOL_MAGIC "mod_transform-spool:"
+/* magic, 16 hex digits of body length, newline */
+#define SPOOL_FOOTER_LEN (sizeof(SPOOL_MAGIC) - 1 + 16 + 1)
+/* Anything bigger than this is not one of ours */
+#define SPOOL_MAX_META (1024 * 1024)
+
+/* The name of the stylesheet transform_run is going to pick */
+static const char *stylesheet_name(request_rec *r, dir_cfg *dconf,
+                                   transform_notes *notes)
+{
+    const char *name = NULL;
+    int i;
+
+    if (ap_is_initial_req(r) && notes->xslt)
+        name = notes->xslt;
+    else if (dconf->xslt)
+        name = dconf->xslt;
+    if (name) {
+        /* The stages of a pipeline follow its first stylesheet */
+        if (dconf->stages && dconf->xslt && !strcmp(name, dconf->xslt)) {
+            for (i = 0; i < dconf->stages->nelts; i++)
+                name = apr_pstrcat(r->pool, name, "\n",
+                                   APR_ARRAY_IDX(dconf->stages, i,
+                                                 const char *), NULL);
+        }
+        return name;
+    }
+    /* The PI is part of the input, so the input file covers it */
+    return dconf->default_xslt ? dconf->default_xslt : "";
+}
+
+static const char *spool_key(request_rec *r, dir_cfg *dconf,
+                             transform_notes *notes)
+{
+    apr_md5_ctx_t md5;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    const char *parts[4];
+    char *hex;
+    int i;
+
+    parts[0] = r->server->server_hostname ? r->server->server_hostname : "";
+    parts[1] = r->filename;
+    parts[2] = stylesheet_name(r, dconf, notes);
+    parts[3] = apr_itoa(r->pool, dconf->opts);
+
+    apr_md5_init(&md5);
+    for (i = 0; i < sizeof(parts) / sizeof(*parts); i++)
+        apr_md5_update(&md5, parts[i], strlen(parts[i]) + 1);
+    apr_md5_final(digest, &md5);
+
+    hex = apr_palloc(r->pool, APR_MD5_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++)
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return hex;
+}
+
+static const char *spool_path(apr_pool_t *p, const char *dir,
+                              const char *key)
+{
+    return apr_pstrcat(p, dir, "/", apr_pstrndup(p, key, 2), "/", key,
+                       NULL);
+}
+
+/**
+ * Request data
+ *
+ * Keys above only cover what every response depends on.  The http plugin
+ * and apache:get() report each request header and query argument they
+ * read, as "H<name>" or "A<name>" in notes->uses, and those become part of
+ * the ETag, the Vary header and the key a response is stored under.  A
+ * transform that read anything else about the client, such as its
+ * address, marks the response uncacheable instead.
+ */
+static const char *arg_value(request_rec *r, const char *name)
+{
+    char *args;
+    char *pair;
+    char *state;
+
+    if (!r->args)
+        return NULL;
+    args = apr_pstrdup(r->pool, r->args);
+    for (pair = apr_strtok(args, "&", &state); pair;
+         pair = apr_strtok(NULL, "&", &state)) {
+        char *value = strchr(pair, '=');
+        if (value)
+            *value++ = '\0';
+        ap_unescape_url(pair);
+        if (!strcmp(pair, name))
+            return value ? value : "1";
+    }
+    return NULL;
+}
+
+static const char *use_value(request_rec *r, const char *use)
+{
+    if (*use == 'H')
+        return apr_table_get(r->headers_in, use + 1);
+    return arg_value(r, use + 1);
+}
+
+static void digest_uses(apr_md5_ctx_t *md5, request_rec *r,
+                        apr_array_header_t *uses)
+{
+    int i;
+
+    for (i = 0; uses && i < uses->nelts; i++) {
+        const char *use = APR_ARRAY_IDX(uses, i, const char *);
+        const char *value = use_value(r, use);
+
+        apr_md5_update(md5, use, strlen(use) + 1);
+        /* Tell a missing value from an empty one */
+        if (value)
+            apr_md5_update(md5, value, strlen(value) + 1);
+        else
+            apr_md5_update(md5, "", 1);
+    }
+}
+
+static void add_vary(request_rec *r, apr_array_header_t *uses)
+{
+    int i;
+
+    for (i = 0; uses && i < uses->nelts; i++) {
+        const char *use = APR_ARRAY_IDX(uses, i, const char *);
+        if (*use == 'H')
+            apr_table_mergen(r->headers_out, "Vary", use + 1);
+    }
+}
+
+void transform_output_vary(request_rec *r)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+
+    if (!notes)
+        return;
+    if (notes->uncacheable)
+        apr_table_setn(r->headers_out, "Cache-Control", "private");
+    else
+        add_vary(r, notes->uses);
+}
+
+/* The key of the variant of a response this request should get */
+static const char *variant_key(request_rec *r, const char *key,
+                               apr_array_header_t *uses)
+{
+    apr_md5_ctx_t md5;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    char *hex;
+    int i;
+
+    if (!uses || !uses->nelts)
+        return key;
+
+    apr_md5_init(&md5);
+    apr_md5_update(&md5, key, strlen(key));
+    digest_uses(&md5, r, uses);
+    apr_md5_final(digest, &md5);
+
+    hex = apr_palloc(r->pool, APR_MD5_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++)
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return hex;
+}
+
+/**
+ * "<base>.vary" lists, one per line, the request data the last response
+ * stored under a base key read.  It is only there when that isn't nothing.
+ */
+static apr_array_header_t *vary_read(request_rec *r, const char *base)
+{
+    apr_array_header_t *uses = NULL;
+    apr_file_t *file;
+    char line[HUGE_STRING_LEN];
+
+    if (apr_file_open(&file, apr_pstrcat(r->pool, base, ".vary", NULL),
+                      APR_READ | APR_BUFFERED, APR_OS_DEFAULT, r->pool)
+        != APR_SUCCESS)
+        return NULL;
+    uses = apr_array_make(r->pool, 4, sizeof(const char *));
+    while (apr_file_gets(line, sizeof(line), file) == APR_SUCCESS) {
+        char *end = line + strlen(line);
+        while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+            *--end = '\0';
+        if (*line == 'H' || *line == 'A')
+            APR_ARRAY_PUSH(uses, const char *) = apr_pstrdup(r->pool, line);
+    }
+    apr_file_close(file);
+    return uses;
+}
+
+static void vary_write(request_rec *r, const char *base,
+                       apr_array_header_t *uses)
+{
+    const char *path = apr_pstrcat(r->pool, base, ".vary", NULL);
+    char *tmp;
+    apr_file_t *file;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    if (!uses || !uses->nelts) {
+        apr_file_remove(path, r->pool);
+        return;
+    }
+
+    tmp = apr_pstrcat(r->pool, path, ".XXXXXX", NULL);
+    if (apr_file_mktemp(&file, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+                        | APR_BUFFERED, r->pool) != APR_SUCCESS)
+        return;
+    for (i = 0; i < uses->nelts && rv == APR_SUCCESS; i++)
+        rv = apr_file_printf(file, "%s\n",
+                             APR_ARRAY_IDX(uses, i, const char *)) < 0
+            ? APR_EGENERAL : APR_SUCCESS;
+    if (apr_file_close(file) != APR_SUCCESS || rv != APR_SUCCESS
+        || apr_file_rename(tmp, path, r->pool) != APR_SUCCESS)
+        apr_file_remove(tmp, r->pool);
+}
+
+static int dep_unchanged(apr_pool_t *p, const char *path, apr_time_t mtime,
+                         apr_ino_t inode, apr_off_t size)
+{
+    apr_finfo_t finfo;
+
+    return apr_stat(&finfo, path,
+                    APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE,
+                    p) == APR_SUCCESS
+        && finfo.mtime == mtime && finfo.inode == inode && finfo.size == size;
+}
+
+/**
+ * Open a spool file and check it is still valid.  On success *length is
+ * the length of the body at the start of the file, *content_type the
+ * content type it was served with and *deps what it was made from.
+ */
+static apr_status_t spool_open(request_rec *r, const char *path,
+                               apr_file_t **file, apr_off_t *length,
+                               const char **content_type,
+                               apr_array_header_t **deps)
+{
+    apr_status_t rv;
+    apr_finfo_t finfo;
+    apr_off_t offset;
+    apr_size_t len;
+    char footer[SPOOL_FOOTER_LEN + 1];
+    char *meta;
+    char *line;
+    char *state;
+    int ndeps;
+
+    rv = apr_file_open(file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT,
+                       r->pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    if ((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, *file))
+        != APR_SUCCESS)
+        goto fail;
+    if (finfo.size < SPOOL_FOOTER_LEN) {
+        rv = APR_EGENERAL;
+        goto fail;
+    }
+
+    offset = finfo.size - SPOOL_FOOTER_LEN;
+    len = SPOOL_FOOTER_LEN;
+    if ((rv = apr_file_seek(*file, APR_SET, &offset)) != APR_SUCCESS
+        || (rv = apr_file_read_full(*file, footer, len, NULL)) != APR_SUCCESS)
+        goto fail;
+    footer[SPOOL_FOOTER_LEN] = '\0';
+    if (strncmp(footer, SPOOL_MAGIC, sizeof(SPOOL_MAGIC) - 1)) {
+        rv = APR_EGENERAL;
+        goto fail;
+    }
+    *length = apr_strtoi64(footer + sizeof(SPOOL_MAGIC) - 1, NULL, 16);
+    if (*length < 0 || *length > finfo.size - SPOOL_FOOTER_LEN
+        || finfo.size - SPOOL_FOOTER_LEN - *length > SPOOL_MAX_META) {
+        rv = APR_EGENERAL;
+        goto fail;
+    }
+
+    offset = *length;
+    len = finfo.size - SPOOL_FOOTER_LEN - *length;
+    meta = apr_palloc(r->pool, len + 1);
+    if ((rv = apr_file_seek(*file, APR_SET, &offset)) != APR_SUCCESS
+        || (rv = apr_file_read_full(*file, meta, len, NULL)) != APR_SUCCESS)
+        goto fail;
+    meta[len] = '\0';
+
+    /* content type, dependency count, then "mtime inode size path" lines */
+    *content_type = apr_strtok(meta, "\n", &state);
+    line = apr_strtok(NULL, "\n", &state);
+    ndeps = line ? atoi(line) : -1;
+    if (!*content_type || ndeps < 0) {
+        rv = APR_EGENERAL;
+        goto fail;
+    }
+    *deps = apr_array_make(r->pool, ndeps, sizeof(transform_xslt_dep));
+    while (ndeps--) {
+        transform_xslt_dep *dep = apr_array_push(*deps);
+        char *end;
+
+        if (!(line = apr_strtok(NULL, "\n", &state))) {
+            rv = APR_EGENERAL;
+            goto fail;
+        }
+        dep->mtime = apr_strtoi64(line, &end, 10);
+        dep->inode = (apr_ino_t) apr_strtoi64(end, &end, 10);
+        dep->size = apr_strtoi64(end, &end, 10);
+        dep->path = end + 1;
+        if (*end != ' ' || !dep_unchanged(r->pool, dep->path, dep->mtime,
+                                          dep->inode, dep->size)) {
+            rv = APR_EGENERAL;
+            goto fail;
+        }
+    }
+    return APR_SUCCESS;
+
+  fail:
+    apr_file_close(*file);
+    return rv;
+}
+
+/**
+ * Validators
+ *
+ * A response from a pure stylesheet (see transform_cache.c) is made from
+ * files only.  Its ETag is a digest of the identity of every one of them,
+ * its Last-Modified the newest of them, and it gets a Cache-Control that
+ * lets shared caches store it.  Each
+ * child remembers which files those were for every static response it
+ * produced, so a revalidation only costs a stat() of each.
+ *
+ * The default handler would answer conditional requests using the input
+ * file alone, which is wrong once a stylesheet changes, so the conditional
+ * headers are hidden from it and evaluated here instead.
+ */
+#define VALIDATOR_MAX 4096
+
+static const char *const conditional_headers[] = {
+    "If-Match", "If-None-Match", "If-Modified-Since", "If-Unmodified-Since",
+    "If-Range", NULL
+};
+
+typedef struct
+{
+    apr_array_header_t *paths;
+    apr_array_header_t *uses;
+}
+transform_validator;
+
+static apr_array_header_t *copy_strings(apr_pool_t *p,
+                                        apr_array_header_t *from)
+{
+    apr_array_header_t *to = apr_array_make(p, from ? from->nelts : 0,
+                                            sizeof(const char *));
+    int i;
+
+    for (i = 0; from && i < from->nelts; i++)
+        APR_ARRAY_PUSH(to, const char *) =
+            apr_pstrdup(p, APR_ARRAY_IDX(from, i, const char *));
+    return to;
+}
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *validator_lock;
+#endif
+static apr_pool_t *validator_pool;
+static apr_hash_t *validator_deps;
+
+void transform_output_hide_conditionals(request_rec *r)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    const char *const *name;
+    const char *value;
+
+    if (!notes)
+        return;
+    for (name = conditional_headers; *name; name++) {
+        if ((value = apr_table_get(r->headers_in, *name)) != NULL) {
+            if (!notes->conditionals)
+                notes->conditionals = apr_table_make(r->pool, 4);
+            apr_table_setn(notes->conditionals, *name, value);
+            apr_table_unset(r->headers_in, *name);
+        }
+    }
+}
+
+static int restore_conditionals(void *data, const char *key,
+                                const char *value)
+{
+    apr_table_setn((apr_table_t *) data, key, value);
+    return 1;
+}
+
+/* Whether the response is made from static files only, so far as we know */
+int transform_output_static(ap_filter_t * f, apr_bucket_brigade * bb)
+{
+    request_rec *r = f->r;
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+
+    /**
+     * The handler has to be sending the file itself, and the stylesheet
+     * can't have been handed to us by another module.
+     */
+    return notes && ap_is_initial_req(r) && r->method_number == M_GET
+        && !notes->document && r->finfo.filetype == APR_REG
+        && !APR_BRIGADE_EMPTY(bb) && APR_BUCKET_IS_FILE(APR_BRIGADE_FIRST(bb));
+}
+
+/**
+ * Set ETag, Last-Modified and Cache-Control.  A compressed copy from the
+ * output cache is a representation of its own, so its ETag carries the
+ * name of its coding after the digest.
+ */
+static void set_validators(request_rec *r, apr_array_header_t *deps,
+                           apr_array_header_t *uses, const char *coding)
+{
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    const char *cache_control = dconf->cache_control ? dconf->cache_control
+        : TRANSFORM_CACHE_CONTROL_DEFAULT;
+    apr_md5_ctx_t md5;
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    transform_xslt_dep *dep = (transform_xslt_dep *) deps->elts;
+    char *hex;
+    int i;
+
+    apr_md5_init(&md5);
+    for (i = 0; i < deps->nelts; i++, dep++) {
+        apr_md5_update(&md5, dep->path, strlen(dep->path) + 1);
+        apr_md5_update(&md5, &dep->mtime, sizeof(dep->mtime));
+        apr_md5_update(&md5, &dep->inode, sizeof(dep->inode));
+        apr_md5_update(&md5, &dep->size, sizeof(dep->size));
+        ap_update_mtime(r, dep->mtime);
+    }
+    digest_uses(&md5, r, uses);
+    apr_md5_final(digest, &md5);
+
+    hex = apr_palloc(r->pool, APR_MD5_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++)
+        apr_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+
+    apr_table_setn(r->headers_out, "ETag",
+                   coding ? apr_psprintf(r->pool, "\"%s-%s\"", hex, coding)
+                   : apr_psprintf(r->pool, "\"%s\"", hex));
+    ap_set_last_modified(r);
+
+    /**
+     * Let shared caches keep it, unless the configuration says otherwise
+     * or the request was authenticated.
+     */
+    if (*cache_control && apr_table_get(r->headers_in, "Authorization"))
+        cache_control = "private";
+    if (*cache_control && !apr_table_get(r->headers_out, "Cache-Control"))
+        apr_table_setn(r->headers_out, "Cache-Control", cache_control);
+}
+
+/**
+ * Answer a conditional request from the validators just set, as the
+ * handler would have without them hidden.  Returns OK when a 304 or 412
+ * was sent instead of the response.
+ */
+int transform_output_preconditions(ap_filter_t * f)
+{
+    int status = ap_meets_conditions(f->r);
+    apr_bucket_brigade *out;
+
+    if (status != HTTP_NOT_MODIFIED && status != HTTP_PRECONDITION_FAILED)
+        return DECLINED;
+    out = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+    f->r->status = status;
+    apr_table_unset(f->r->headers_out, "Content-Length");
+    APR_BRIGADE_INSERT_TAIL(out, apr_bucket_eos_create(out->bucket_alloc));
+    ap_pass_brigade(f->next, out);
+    return OK;
+}
+
+static void conditional_coding(request_rec *r);
+
+/**
+ * Called on the first brigade of every response.  Returns OK when a 304
+ * or 412 was sent from the validators of an earlier response.
+ */
+int transform_output_conditional(ap_filter_t * f, apr_bucket_brigade * bb)
+{
+    request_rec *r = f->r;
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    transform_validator *v;
+    apr_array_header_t *paths = NULL;
+    apr_array_header_t *uses = NULL;
+    apr_array_header_t *deps;
+    const char *key;
+    int i;
+
+    /* The handler's validators describe the input, not what we send */
+    apr_table_unset(r->headers_out, "ETag");
+    apr_table_unset(r->headers_out, "Last-Modified");
+    if (notes && notes->conditionals) {
+        apr_table_do(restore_conditionals, r->headers_in,
+                     notes->conditionals, NULL);
+        notes->conditionals = NULL;
+    }
+
+    if (!transform_output_static(f, bb) || !validator_deps)
+        return DECLINED;
+
+    key = spool_key(r, dconf, notes);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(validator_lock);
+#endif
+    if ((v = apr_hash_get(validator_deps, key, APR_HASH_KEY_STRING))) {
+        paths = copy_strings(r->pool, v->paths);
+        uses = copy_strings(r->pool, v->uses);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(validator_lock);
+#endif
+    if (!paths)
+        return DECLINED;
+
+    /**
+     * Anything new the response could depend on would have to come from
+     * a change to one of these files, and that changes the ETag anyway.
+     */
+    deps = apr_array_make(r->pool, paths->nelts, sizeof(transform_xslt_dep));
+    for (i = 0; i < paths->nelts; i++) {
+        transform_xslt_dep *dep = apr_array_push(deps);
+        apr_finfo_t finfo;
+
+        dep->path = APR_ARRAY_IDX(paths, i, const char *);
+        if (apr_stat(&finfo, dep->path,
+                     APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE,
+                     r->pool) != APR_SUCCESS)
+            return DECLINED;
+        dep->mtime = finfo.mtime;
+        dep->inode = finfo.inode;
+        dep->size = finfo.size;
+    }
+
+    set_validators(r, deps, uses, NULL);
+    conditional_coding(r);
+    add_vary(r, uses);
+    return transform_output_preconditions(f);
+}
+
+static void spool_dep(apr_array_header_t *deps, const char *path,
+                      apr_time_t mtime, apr_ino_t inode, apr_off_t size)
+{
+    transform_xslt_dep *dep = apr_array_push(deps);
+
+    dep->path = path;
+    dep->mtime = mtime;
+    dep->inode = inode;
+    dep->size = size;
+}
+
+/**
+ * Everything a transformed response was made from: the input file, the
+ * files each stylesheet was compiled from, as they were then, and whatever
+ * was read while transforming, as it is now.  NULL if any of it isn't a
+ * file or a stylesheet can't be tracked.
+ */
+apr_array_header_t *transform_output_deps(request_rec *r,
+                                          apr_array_header_t *stages)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    apr_array_header_t *deps;
+    transform_stage *stage;
+    transform_xslt_dep *dep;
+    apr_finfo_t finfo;
+    int i;
+    int j;
+
+    if (!notes || notes->uncacheable)
+        return NULL;
+    /* A stylesheet reading the request makes every response different */
+    stage = (transform_stage *) stages->elts;
+    for (j = 0; j < stages->nelts; j++, stage++) {
+        if (!stage->entry || !stage->entry->pure)
+            return NULL;
+    }
+
+    deps = apr_array_make(r->pool, 8, sizeof(transform_xslt_dep));
+    spool_dep(deps, r->filename, r->finfo.mtime, r->finfo.inode,
+              r->finfo.size);
+    stage = (transform_stage *) stages->elts;
+    for (j = 0; j < stages->nelts; j++, stage++) {
+        dep = (transform_xslt_dep *) stage->entry->deps->elts;
+        for (i = 0; i < stage->entry->deps->nelts; i++, dep++)
+            spool_dep(deps, apr_pstrdup(r->pool, dep->path), dep->mtime,
+                      dep->inode, dep->size);
+    }
+    for (i = 0; notes->deps && i < notes->deps->nelts; i++) {
+        const char *path = APR_ARRAY_IDX(notes->deps, i, const char *);
+        if (!path || apr_stat(&finfo, path,
+                              APR_FINFO_MTIME | APR_FINFO_SIZE
+                              | APR_FINFO_INODE, r->pool) != APR_SUCCESS)
+            return NULL;
+        spool_dep(deps, path, finfo.mtime, finfo.inode, finfo.size);
+    }
+    return deps;
+}
+
+/* Set the validators of a response about to be sent, and remember them */
+void transform_output_validators(request_rec *r, apr_array_header_t *deps)
+{
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    transform_validator *v;
+    const char *key;
+    int i;
+
+    set_validators(r, deps, notes->uses, NULL);
+    if (!validator_deps)
+        return;
+
+    key = spool_key(r, dconf, notes);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(validator_lock);
+#endif
+    /* Start over rather than grow without bound */
+    if (apr_hash_count(validator_deps) >= VALIDATOR_MAX) {
+        apr_pool_clear(validator_pool);
+        validator_deps = apr_hash_make(validator_pool);
+    }
+    v = apr_palloc(validator_pool, sizeof(transform_validator));
+    v->paths = apr_array_make(validator_pool, deps->nelts,
+                              sizeof(const char *));
+    for (i = 0; i < deps->nelts; i++)
+        APR_ARRAY_PUSH(v->paths, const char *) =
+            apr_pstrdup(validator_pool,
+                        APR_ARRAY_IDX(deps, i, transform_xslt_dep).path);
+    v->uses = copy_strings(validator_pool, notes->uses);
+    apr_hash_set(validator_deps, apr_pstrdup(validator_pool, key),
+                 APR_HASH_KEY_STRING, v);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(validator_lock);
+#endif
+}
+
+/**
+ * Compressed copies of each spool file are stored next to it, in the same
+ * format, so that compression runs once per change rather than once per
+ * response.
+ */
+typedef struct
+{
+    const char *suffix;
+    const char *encoding;
+    apr_status_t (*compress) (apr_pool_t *p, apr_file_t *in,
+                              apr_off_t length, apr_file_t *out,
+                              apr_off_t *written);
+}
+transform_spool_coding;
+
+#define SPOOL_CHUNK (64 * 1024)
+
+#if HAVE_BROTLI_ENCODE_H && HAVE_LIBBROTLIENC
+static apr_status_t spool_brotli(apr_pool_t *p, apr_file_t *in,
+                                 apr_off_t length, apr_file_t *out,
+                                 apr_off_t *written)
+{
+    BrotliEncoderState *bs;
+    BrotliEncoderOperation op;
+    unsigned char *ibuf = apr_palloc(p, SPOOL_CHUNK);
+    unsigned char *obuf = apr_palloc(p, SPOOL_CHUNK);
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!(bs = BrotliEncoderCreateInstance(NULL, NULL, NULL)))
+        return APR_ENOMEM;
+    BrotliEncoderSetParameter(bs, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+
+    do {
+        size_t n = length > SPOOL_CHUNK ? SPOOL_CHUNK : (size_t) length;
+        size_t avail_in = n;
+        const uint8_t *next_in = ibuf;
+
+        if (n && (rv = apr_file_read_full(in, ibuf, n, NULL)) != APR_SUCCESS)
+            break;
+        length -= n;
+        op = length ? BROTLI_OPERATION_PROCESS : BROTLI_OPERATION_FINISH;
+        do {
+            size_t avail_out = SPOOL_CHUNK;
+            uint8_t *next_out = obuf;
+
+            if (!BrotliEncoderCompressStream(bs, op, &avail_in, &next_in,
+                                             &avail_out, &next_out, NULL)) {
+                rv = APR_EGENERAL;
+                break;
+            }
+            rv = apr_file_write_full(out, obuf, SPOOL_CHUNK - avail_out,
+                                     NULL);
+            *written += SPOOL_CHUNK - avail_out;
+        } while (rv == APR_SUCCESS
+                 && (avail_in || BrotliEncoderHasMoreOutput(bs)
+                     || (op == BROTLI_OPERATION_FINISH
+                         && !BrotliEncoderIsFinished(bs))));
+    } while (rv == APR_SUCCESS && op != BROTLI_OPERATION_FINISH);
+
+    BrotliEncoderDestroyInstance(bs);
+    return rv;
+}
+#endif
+
+#if HAVE_ZLIB_H && HAVE_LIBZ
+static apr_status_t spool_gzip(apr_pool_t *p, apr_file_t *in,
+                               apr_off_t length, apr_file_t *out,
+                               apr_off_t *written)
+{
+    z_stream zs;
+    int flush;
+    unsigned char *ibuf = apr_palloc(p, SPOOL_CHUNK);
+    unsigned char *obuf = apr_palloc(p, SPOOL_CHUNK);
+    apr_status_t rv = APR_SUCCESS;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 16 + MAX_WBITS: gzip header and trailer rather than zlib's */
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return APR_ENOMEM;
+
+    do {
+        apr_size_t n = length > SPOOL_CHUNK ? SPOOL_CHUNK : (apr_size_t) length;
+
+        if (n && (rv = apr_file_read_full(in, ibuf, n, NULL)) != APR_SUCCESS)
+            break;
+        length -= n;
+        flush = length ? Z_NO_FLUSH : Z_FINISH;
+        zs.next_in = ibuf;
+        zs.avail_in = n;
+        do {
+            zs.next_out = obuf;
+            zs.avail_out = SPOOL_CHUNK;
+            if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+                rv = APR_EGENERAL;
+                break;
+            }
+            rv = apr_file_write_full(out, obuf, SPOOL_CHUNK - zs.avail_out,
+                                     NULL);
+            *written += SPOOL_CHUNK - zs.avail_out;
+        } while (rv == APR_SUCCESS && zs.avail_out == 0);
+    } while (rv == APR_SUCCESS && flush != Z_FINISH);
+
+    deflateEnd(&zs);
+    return rv;
+}
+#endif
+
+/* In order of preference */
+static const transform_spool_coding spool_codings[] = {
+#if HAVE_BROTLI_ENCODE_H && HAVE_LIBBROTLIENC
+    {".br", "br", spool_brotli},
+#endif
+#if HAVE_ZLIB_H && HAVE_LIBZ
+    {".gz", "gzip", spool_gzip},
+#endif
+    {NULL, NULL, NULL}
+};
+
+/* Whether an Accept-Encoding header allows a content coding */
+static int accepts_coding(apr_pool_t *p, const char *accept,
+                          const char *encoding)
+{
+    char *list = apr_pstrdup(p, accept);
+    char *item;
+    char *state;
+    int star = 0;
+
+    for (item = apr_strtok(list, ",", &state); item;
+         item = apr_strtok(NULL, ",", &state)) {
+        char *params = strchr(item, ';');
+        char *end;
+        int acceptable = 1;
+
+        if (params) {
+            const char *q;
+            *params++ = '\0';
+            if ((q = strstr(params, "q=")) != NULL)
+                acceptable = strtod(q + 2, NULL) > 0;
+        }
+        while (apr_isspace(*item))
+            item++;
+        for (end = item + strlen(item); end > item && apr_isspace(end[-1]);)
+            *--end = '\0';
+
+        if (!strcasecmp(item, encoding)
+            || (!strcasecmp(encoding, "gzip") && !strcasecmp(item, "x-gzip")))
+            return acceptable;
+        if (!strcmp(item, "*"))
+            star = acceptable;
+    }
+    return star;
+}
+
+/**
+ * A client holding a compressed copy from the output cache names it in
+ * If-None-Match by that copy's ETag.  Compare against that one instead,
+ * if the client would still be sent that coding.
+ */
+static void conditional_coding(request_rec *r)
+{
+    const char *match = apr_table_get(r->headers_in, "If-None-Match");
+    const char *accept = apr_table_get(r->headers_in, "Accept-Encoding");
+    const char *etag = apr_table_get(r->headers_out, "ETag");
+    const transform_spool_coding *coding;
+    const char *tag;
+
+    if (!match || !accept || !etag)
+        return;
+    for (coding = spool_codings; coding->suffix; coding++) {
+        tag = apr_psprintf(r->pool, "%.*s-%s\"", (int) strlen(etag) - 1,
+                           etag, coding->suffix + 1);
+        if (strstr(match, tag)
+            && accepts_coding(r->pool, accept, coding->encoding)) {
+            apr_table_setn(r->headers_out, "ETag", tag);
+            return;
+        }
+    }
+}
+
+/**
+ * Send a stored response, in the best encoding the client accepts that
+ * is still valid.  Returns OK if one was sent.
+ */
+static int spool_serve(ap_filter_t * f, transform_spool * spool)
+{
+    request_rec *r = f->r;
+    apr_array_header_t *uses = vary_read(r, spool->base);
+    const char *path = spool_path(r->pool, spool->dir,
+                                  variant_key(r, spool->key, uses));
+    const char *content_type;
+    const char *accept = apr_table_get(r->headers_in, "Accept-Encoding");
+    const transform_spool_coding *coding;
+    apr_array_header_t *deps;
+    apr_file_t *file;
+    apr_off_t length;
+    apr_bucket_brigade *out;
+    apr_bucket *b;
+
+    for (coding = spool_codings; accept && coding->suffix; coding++) {
+        if (accepts_coding(r->pool, accept, coding->encoding)
+            && spool_open(r, apr_pstrcat(r->pool, path, coding->suffix, NULL),
+                          &file, &length, &content_type, &deps)
+            == APR_SUCCESS)
+            break;
+    }
+    if (!accept || !coding->suffix) {
+        coding = NULL;
+        if (spool_open(r, path, &file, &length, &content_type, &deps)
+            != APR_SUCCESS)
+            return DECLINED;
+    }
+
+    /* The suffix without its dot names the coding in the ETag */
+    set_validators(r, deps, uses, coding ? coding->suffix + 1 : NULL);
+    add_vary(r, uses);
+    if (transform_output_preconditions(f) == OK) {
+        apr_file_close(file);
+        return OK;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "mod_transform: Serving %s from %s%s", r->filename, path,
+                  coding ? coding->suffix : "");
+    ap_set_content_type(r, apr_pstrdup(r->pool, content_type));
+    ap_set_content_length(r, length);
+    if (coding)
+        r->content_encoding = coding->encoding;
+
+    out = apr_brigade_create(r->pool, f->c->bucket_alloc);
+    if (length > 0) {
+        b = apr_bucket_file_create(file, 0, (apr_size_t) length, r->pool,
+                                   out->bucket_alloc);
+        APR_BRIGADE_INSERT_TAIL(out, b);
+    }
+    b = apr_bucket_eos_create(out->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(out, b);
+    ap_pass_brigade(f->next, out);
+    return OK;
+}
+
+/**
+ * Request collapsing
+ *
+ * Only one request at a time transforms a given missing response.  Within
+ * a child the spool paths being produced are kept in a table; across
+ * children the producer holds a lock on "<path>.lock".  Everybody else
+ * waits for the spool file to appear, for at most TransformOutputCacheWait,
+ * then gives up and transforms for themselves.
+ */
+#define COLLAPSE_POLL apr_time_from_msec(50)
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *collapse_lock;
+static apr_thread_cond_t *collapse_cond;
+#endif
+static apr_hash_t *collapse_inflight;
+
+
+/* Try to become the one request producing path */
+static int collapse_begin(request_rec *r, transform_spool * spool)
+{
+    int leader = 0;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(collapse_lock);
+#endif
+    if (!apr_hash_get(collapse_inflight, spool->collapse,
+                      APR_HASH_KEY_STRING)) {
+        if (apr_file_open(&spool->lock,
+                          apr_pstrcat(r->pool, spool->collapse, ".lock",
+                                      NULL),
+                          APR_CREATE | APR_WRITE, APR_OS_DEFAULT, r->pool)
+            != APR_SUCCESS) {
+            /* Can't coordinate with the other children: just go ahead */
+            spool->lock = NULL;
+            leader = 1;
+        }
+        else if (apr_file_lock(spool->lock, APR_FLOCK_EXCLUSIVE
+                               | APR_FLOCK_NONBLOCK) == APR_SUCCESS) {
+            leader = 1;
+        }
+        else {
+            apr_file_close(spool->lock);
+            spool->lock = NULL;
+        }
+        if (leader) {
+            apr_hash_set(collapse_inflight, spool->collapse,
+                         APR_HASH_KEY_STRING, spool);
+            spool->leader = 1;
+        }
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(collapse_lock);
+#endif
+    return leader;
+}
+
+/* Whether a response is still being produced by somebody else */
+static int collapse_busy(request_rec *r, const char *path)
+{
+    apr_file_t *lock;
+    int busy;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(collapse_lock);
+#endif
+    /**
+     * With fcntl() locks, closing any descriptor of the lock file drops
+     * the locks this process holds on it, so only look at the file when
+     * no thread here is producing it.
+     */
+    busy = apr_hash_get(collapse_inflight, path, APR_HASH_KEY_STRING) != NULL;
+    if (!busy && apr_file_open(&lock, apr_pstrcat(r->pool, path, ".lock",
+                                                  NULL), APR_WRITE,
+                               APR_OS_DEFAULT, r->pool) == APR_SUCCESS) {
+        if (apr_file_lock(lock, APR_FLOCK_EXCLUSIVE | APR_FLOCK_NONBLOCK)
+            == APR_SUCCESS)
+            apr_file_unlock(lock);
+        else
+            busy = 1;
+        apr_file_close(lock);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(collapse_lock);
+#endif
+    return busy;
+}
+
+/* Wait a little for whoever is producing a response to finish */
+static void collapse_wait(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(collapse_lock);
+    apr_thread_cond_timedwait(collapse_cond, collapse_lock, COLLAPSE_POLL);
+    apr_thread_mutex_unlock(collapse_lock);
+#else
+    apr_sleep(COLLAPSE_POLL);
+#endif
+}
+
+/* Let waiting requests look for the response */
+static void collapse_end(transform_spool * spool)
+{
+    if (!spool->leader)
+        return;
+    spool->leader = 0;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(collapse_lock);
+#endif
+    apr_hash_set(collapse_inflight, spool->collapse, APR_HASH_KEY_STRING, NULL);
+    if (spool->lock) {
+        apr_file_unlock(spool->lock);
+        apr_file_close(spool->lock);
+        spool->lock = NULL;
+    }
+#if APR_HAS_THREADS
+    apr_thread_cond_broadcast(collapse_cond);
+    apr_thread_mutex_unlock(collapse_lock);
+#endif
+}
+
+static apr_status_t spool_cleanup(void *data)
+{
+    transform_spool *spool = data;
+
+    if (spool->file) {
+        apr_file_close(spool->file);
+        apr_file_remove(spool->tmp_path, spool->pool);
+        spool->file = NULL;
+    }
+    collapse_end(spool);
+    return APR_SUCCESS;
+}
+
+apr_status_t transform_output_child_init(apr_pool_t *p, server_rec *s)
+{
+    collapse_inflight = apr_hash_make(p);
+    apr_pool_create(&validator_pool, p);
+    validator_deps = apr_hash_make(validator_pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&collapse_lock, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_thread_cond_create(&collapse_cond, p);
+    apr_thread_mutex_create(&validator_lock, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    return APR_SUCCESS;
+}
+
+/**
+ * "<base>.nostore" is there while the last transform under a base key
+ * made a response that couldn't be stored: an impure stylesheet, or one
+ * that read something that makes it uncacheable.
+ */
+static int spool_nostore(request_rec *r, transform_spool * spool)
+{
+    apr_finfo_t finfo;
+
+    return apr_stat(&finfo, apr_pstrcat(r->pool, spool->base, ".nostore",
+                                        NULL), APR_FINFO_TYPE, r->pool)
+        == APR_SUCCESS;
+}
+
+/**
+ * Called on the first brigade.  Returns OK when the response was served
+ * from the spool, otherwise DECLINED, with *spool set when the output of
+ * this request should be spooled.
+ */
+int transform_output_lookup(ap_filter_t * f, apr_bucket_brigade * bb,
+                            transform_spool ** spool)
+{
+    request_rec *r = f->r;
+    dir_cfg *dconf = ap_get_module_config(r->per_dir_config,
+                                          &transform_module);
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    transform_spool *sp;
+    apr_interval_time_t wait;
+    apr_time_t deadline;
+    apr_file_t *file;
+    char *tmp;
+
+    *spool = NULL;
+
+    if (!dconf->output_cache || !transform_output_static(f, bb))
+        return DECLINED;
+
+    sp = apr_pcalloc(r->pool, sizeof(transform_spool));
+    sp->pool = r->pool;
+    sp->dir = dconf->output_cache;
+    sp->key = spool_key(r, dconf, notes);
+    sp->base = spool_path(r->pool, sp->dir, sp->key);
+    apr_pool_cleanup_register(r->pool, sp, spool_cleanup,
+                              apr_pool_cleanup_null);
+
+    if (spool_codings[0].suffix)
+        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+
+    if (spool_serve(f, sp) == OK)
+        return OK;
+    /* A HEAD request won't produce a body to store */
+    if (r->header_only)
+        return DECLINED;
+
+    apr_dir_make(ap_make_dirstr_parent(r->pool, sp->base), APR_OS_DEFAULT,
+                 r->pool);
+
+    /**
+     * Miss: wait for an identical request that is already on it.  If it
+     * finishes without storing anything, or takes too long, transform
+     * this one too rather than queueing behind each other.  Requests
+     * only wait for the variant they would be served, and not at all
+     * once a response under this key turned out not to be storable.
+     */
+    sp->collapse = spool_path(r->pool, sp->dir,
+                              variant_key(r, sp->key, vary_read(r, sp->base)));
+    apr_dir_make(ap_make_dirstr_parent(r->pool, sp->collapse),
+                 APR_OS_DEFAULT, r->pool);
+    if (!spool_nostore(r, sp) && !collapse_begin(r, sp)) {
+        wait = dconf->output_wait >= 0 ? dconf->output_wait
+            : TRANSFORM_OUTPUT_WAIT_DEFAULT;
+        deadline = apr_time_now() + wait;
+        do {
+            collapse_wait();
+            if (spool_serve(f, sp) == OK)
+                return OK;
+        } while (apr_time_now() < deadline
+                 && collapse_busy(r, sp->collapse));
+        if (spool_serve(f, sp) == OK)
+            return OK;
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                      "mod_transform: No cached output for %s after waiting, "
+                      "transforming it again", r->filename);
+    }
+
+    /* Spool this response under a temporary name */
+    tmp = apr_pstrcat(r->pool, sp->base, ".XXXXXX", NULL);
+    if (apr_file_mktemp(&file, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+                        | APR_BINARY | APR_BUFFERED, r->pool)
+        != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                      "mod_transform: Cannot create spool file in %s",
+                      dconf->output_cache);
+        collapse_end(sp);
+        return DECLINED;
+    }
+
+    sp->tmp_path = tmp;
+    sp->file = file;
+    *spool = sp;
+    return DECLINED;
+}
+
+void transform_spool_write(transform_spool * spool, const char *buffer,
+                           apr_size_t len)
+{
+    if (spool->file && !spool->failed && len) {
+        if (apr_file_write_full(spool->file, buffer, len, NULL)
+            != APR_SUCCESS)
+            spool->failed = 1;
+        spool->length += len;
+    }
+}
+
+/* Append the metadata and footer after a body of the given length */
+static apr_status_t spool_finish(apr_file_t *file, const char *meta,
+                                 apr_off_t length)
+{
+    char footer[SPOOL_FOOTER_LEN + 1];
+    apr_status_t rv;
+
+    apr_snprintf(footer, sizeof(footer), SPOOL_MAGIC "%016"
+                 APR_UINT64_T_HEX_FMT "\n", (apr_uint64_t) length);
+    if ((rv = apr_file_write_full(file, meta, strlen(meta), NULL))
+        != APR_SUCCESS)
+        return rv;
+    return apr_file_write_full(file, footer, SPOOL_FOOTER_LEN, NULL);
+}
+
+/**
+ * The transform succeeded: record what the body was made from and move
+ * the spool file into place, then wake up whoever is waiting for it.
+ * Without a dependency list the response can't be validated later, so
+ * nothing is stored.
+ */
+static void spool_store(request_rec *r, transform_spool * spool,
+                        apr_array_header_t *deps)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+    apr_array_header_t *lines;
+    transform_xslt_dep *dep;
+    const char *meta;
+    int i;
+
+    if (!spool->file || spool->failed || !deps || !r->content_type)
+        return;
+
+    lines = apr_array_make(r->pool, deps->nelts, sizeof(const char *));
+    dep = (transform_xslt_dep *) deps->elts;
+    for (i = 0; i < deps->nelts; i++, dep++)
+        APR_ARRAY_PUSH(lines, const char *) =
+            apr_psprintf(r->pool, "%" APR_INT64_T_FMT " %" APR_INT64_T_FMT
+                         " %" APR_INT64_T_FMT " %s\n",
+                         (apr_int64_t) dep->mtime, (apr_int64_t) dep->inode,
+                         (apr_int64_t) dep->size, dep->path);
+
+    meta = apr_psprintf(r->pool, "%s\n%d\n%s", r->content_type,
+                        lines->nelts, apr_array_pstrcat(r->pool, lines, 0));
+
+    if (spool_finish(spool->file, meta, spool->length) != APR_SUCCESS
+        || apr_file_close(spool->file) != APR_SUCCESS)
+        return;
+    spool->file = NULL;
+
+    /* Requests that read request data are stored per value of it */
+    spool->path = spool_path(r->pool, spool->dir,
+                             variant_key(r, spool->key, notes->uses));
+    apr_dir_make(ap_make_dirstr_parent(r->pool, spool->path), APR_OS_DEFAULT,
+                 r->pool);
+    vary_write(r, spool->base, notes->uses);
+    if (apr_file_rename(spool->tmp_path, spool->path, r->pool)
+        == APR_SUCCESS)
+        spool->meta = meta;
+    else
+        apr_file_remove(spool->tmp_path, r->pool);
+}
+
+void transform_spool_commit(request_rec *r, transform_spool * spool,
+                            apr_array_header_t *deps)
+{
+    const char *nostore = apr_pstrcat(r->pool, spool->base, ".nostore",
+                                      NULL);
+    apr_file_t *file;
+
+    spool_store(r, spool, deps);
+    /* Identical requests shouldn't wait for what will never be stored */
+    if (!deps && !spool_nostore(r, spool)) {
+        if (apr_file_open(&file, nostore, APR_CREATE | APR_WRITE,
+                          APR_OS_DEFAULT, r->pool) == APR_SUCCESS)
+            apr_file_close(file);
+    }
+    else if (spool->meta) {
+        apr_file_remove(nostore, r->pool);
+    }
+    collapse_end(spool);
+}
+
+/**
+ * Store the compressed copies of a spool file that was just committed.
+ * This runs after the response has been passed on, so only the first
+ * client to see a change waits for it, and only on the connection.
+ */
+void transform_spool_compress(request_rec *r, transform_spool * spool)
+{
+    const transform_spool_coding *coding;
+
+    if (!spool->meta)
+        return;
+
+    for (coding = spool_codings; coding->suffix; coding++) {
+        const char *path = apr_pstrcat(r->pool, spool->path, coding->suffix,
+                                       NULL);
+        char *tmp = apr_pstrcat(r->pool, path, ".XXXXXX", NULL);
+        apr_file_t *in;
+        apr_file_t *out;
+        apr_off_t written = 0;
+        apr_status_t rv;
+
+        if (apr_file_open(&in, spool->path, APR_READ | APR_BINARY,
+                          APR_OS_DEFAULT, r->pool) != APR_SUCCESS)
+            return;
+        if (apr_file_mktemp(&out, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+                            | APR_BINARY | APR_BUFFERED, r->pool)
+            != APR_SUCCESS) {
+            apr_file_close(in);
+            return;
+        }
+
+        rv = coding->compress(r->pool, in, spool->length, out, &written);
+        if (rv == APR_SUCCESS)
+            rv = spool_finish(out, spool->meta, written);
+        apr_file_close(in);
+        if (apr_file_close(out) != APR_SUCCESS && rv == APR_SUCCESS)
+            rv = APR_EGENERAL;
+        if (rv != APR_SUCCESS
+            || apr_file_rename(tmp, path, r->pool) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                          "mod_transform: Cannot store %s", path);
+            apr_file_remove(tmp, r->pool);
+        }
+    }
+}
@@ -0,0 +1,671 @@
+/**
+ *    Copyright (c) 2002 WebThing Ltd
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *    Authors:    Nick Kew <nick webthing.com>
+ *                Edward Rudd <urkle at outoforder dot com>
+ *                Paul Querna <chip at outoforder dot com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Native Serializer
+ *
+ * With TransformOptions NativeOutput, results of the xml output method
+ * are written out here instead of by xsltSaveResultTo.  Text and
+ * attribute values are scanned 16 or 32 bytes at a time (SSE2 or AVX2,
+ * whichever the module was compiled for, byte by byte otherwise) for
+ * what needs escaping, and the runs in between are copied as they are.
+ *
+ * The output has to be the same, byte for byte, as libxml2's, so only
+ * what is known to come out the same is done here: the html, xhtml and
+ * text methods, indenting and XHTML doctypes go to xsltSaveResultTo, and
+ * nodes other than elements, text, CDATA, comments, processing
+ * instructions and entity references to xmlNodeDumpOutput.  Serializers
+ * differ between libxml2 releases, so each child first serializes a
+ * sample result both ways, and leaves everything to libxml2 if they
+ * don't match.
+ */
+
+#include "mod_transform_private.h"
+
+#include <libxml/parserInternals.h>
+#include <libxml/chvalid.h>
+#include <libxslt/imports.h>
+#include <libxslt/xsltInternals.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* What a scan stops at, besides the end of the string */
+#define ESCAPE_TEXT     1       /* < > & CR */
+#define ESCAPE_ATTR     2       /* the above and " LF TAB */
+#define ESCAPE_ASCII    4       /* anything not ASCII */
+
+static int serialize_ok;
+
+#if defined(__AVX2__)
+
+static unsigned int scan_block(__m256i x, int mode)
+{
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('<')),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('>'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('&')),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r'))));
+    unsigned int bits;
+
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_setzero_si256()));
+    if (mode & ESCAPE_ATTR)
+        m = _mm256_or_si256(m, _mm256_or_si256(
+            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')))));
+    bits = (unsigned int) _mm256_movemask_epi8(m);
+    if (mode & ESCAPE_ASCII)
+        bits |= (unsigned int) _mm256_movemask_epi8(x);
+    return bits;
+}
+
+/**
+ * The first byte from s on that a scan in mode stops at.  Loads are
+ * aligned, so they never cross into a page the string doesn't reach.
+ */
+static const xmlChar *scan(const xmlChar *s, int mode)
+{
+    apr_size_t skew = (apr_size_t) s & 31;
+    const __m256i *v = (const __m256i *) (s - skew);
+    unsigned int bits = scan_block(_mm256_load_si256(v), mode) >> skew;
+
+    if (bits)
+        return s + __builtin_ctz(bits);
+    for (;;) {
+        bits = scan_block(_mm256_load_si256(++v), mode);
+        if (bits)
+            return (const xmlChar *) v + __builtin_ctz(bits);
+    }
+}
+
+#elif defined(__SSE2__)
+
+static unsigned int scan_block(__m128i x, int mode)
+{
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('<')),
+                     _mm_cmpeq_epi8(x, _mm_set1_epi8('>'))),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('&')),
+                     _mm_cmpeq_epi8(x, _mm_set1_epi8('\r'))));
+    unsigned int bits;
+
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+    if (mode & ESCAPE_ATTR)
+        m = _mm_or_si128(m, _mm_or_si128(
+            _mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('\t')))));
+    bits = (unsigned int) _mm_movemask_epi8(m);
+    if (mode & ESCAPE_ASCII)
+        bits |= (unsigned int) _mm_movemask_epi8(x);
+    return bits;
+}
+
+/**
+ * The first byte from s on that a scan in mode stops at.  Loads are
+ * aligned, so they never cross into a page the string doesn't reach.
+ */
+static const xmlChar *scan(const xmlChar *s, int mode)
+{
+    apr_size_t skew = (apr_size_t) s & 15;
+    const __m128i *v = (const __m128i *) (s - skew);
+    unsigned int bits = scan_block(_mm_load_si128(v), mode) >> skew;
+
+    if (bits)
+        return s + __builtin_ctz(bits);
+    for (;;) {
+        bits = scan_block(_mm_load_si128(++v), mode);
+        if (bits)
+            return (const xmlChar *) v + __builtin_ctz(bits);
+    }
+}
+
+#else
+
+static unsigned char stops[256];
+
+static void scan_init(void)
+{
+    int c;
+
+    stops[0] = ESCAPE_TEXT | ESCAPE_ATTR | ESCAPE_ASCII;
+    stops['<'] = stops['>'] = stops['&'] = stops['\r'] =
+        ESCAPE_TEXT | ESCAPE_ATTR;
+    stops['"'] = stops['\n'] = stops['\t'] = ESCAPE_ATTR;
+    for (c = 0x80; c < 0x100; c++)
+        stops[c] = ESCAPE_ASCII;
+}
+
+/* The first byte from s on that a scan in mode stops at */
+static const xmlChar *scan(const xmlChar *s, int mode)
+{
+    /* ESCAPE_ATTR stops wherever ESCAPE_TEXT does */
+    int mask = mode | (mode & ESCAPE_ATTR ? ESCAPE_TEXT : 0);
+
+    while (!(stops[*s] & mask))
+        s++;
+    return s;
+}
+
+#endif
+
+/**
+ * Output is gathered here and handed to libxml2 in large blocks, rather
+ * than a few bytes at a time.
+ */
+#define SERIALIZE_BUFFER 16384
+
+typedef struct serializer
+{
+    xmlOutputBufferPtr out;
+    apr_size_t used;
+    char buf[SERIALIZE_BUFFER];
+}
+serializer;
+
+static void flush(serializer *w)
+{
+    if (w->used)
+        xmlOutputBufferWrite(w->out, (int) w->used, w->buf);
+    w->used = 0;
+}
+
+static void put(serializer *w, apr_size_t len, const char *data)
+{
+    if (len > SERIALIZE_BUFFER - w->used) {
+        flush(w);
+        if (len >= SERIALIZE_BUFFER) {
+            xmlOutputBufferWrite(w->out, (int) len, data);
+            return;
+        }
+    }
+    memcpy(w->buf + w->used, data, len);
+    w->used += len;
+}
+
+#define PUT(w, len, data) put(w, (apr_size_t) (len), data)
+#define WRITE_LITERAL(w, s) PUT(w, sizeof(s) - 1, s)
+
+static void write_string(serializer *w, const xmlChar *s)
+{
+    if (s)
+        PUT(w, xmlStrlen(s), (const char *) s);
+}
+
+/**
+ * Write a character reference for the UTF-8 sequence at s, as libxml2
+ * does for attributes of documents without an encoding.  Returns its
+ * length, or 0 if it isn't valid UTF-8.
+ */
+static int write_charref(serializer *w, const xmlChar *s)
+{
+    char ref[16];
+    int val;
+    int len;
+
+    if (s[0] < 0xC0 || !s[1])
+        return 0;
+    if (s[0] < 0xE0) {
+        val = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        len = 2;
+    }
+    else if (s[0] < 0xF0 && s[2]) {
+        val = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        len = 3;
+    }
+    else if (s[0] < 0xF8 && s[2] && s[3]) {
+        val = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12)
+            | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        len = 4;
+    }
+    else {
+        return 0;
+    }
+    if (!IS_CHAR(val))
+        return 0;
+    PUT(w, apr_snprintf(ref, sizeof(ref), "&#x%X;", val),
+                         ref);
+    return len;
+}
+
+/* Write s escaped for text, or for an attribute value of attr */
+static void write_escaped(serializer *w, const xmlChar *s,
+                          xmlAttrPtr attr)
+{
+    int mode = ESCAPE_TEXT;
+    const xmlChar *run;
+    xmlBufferPtr rest;
+    int len;
+
+    if (attr) {
+        mode = ESCAPE_ATTR;
+        if (!attr->doc || !attr->doc->encoding)
+            mode |= ESCAPE_ASCII;
+    }
+
+    for (;;) {
+        run = s;
+        s = scan(s, mode);
+        if (s > run)
+            PUT(w, s - run, (const char *) run);
+        switch (*s) {
+        case '\0':
+            return;
+        case '<':
+            WRITE_LITERAL(w, "&lt;");
+            break;
+        case '>':
+            WRITE_LITERAL(w, "&gt;");
+            break;
+        case '&':
+            WRITE_LITERAL(w, "&amp;");
+            break;
+        case '\r':
+            WRITE_LITERAL(w, "&#13;");
+            break;
+        case '"':
+            WRITE_LITERAL(w, "&quot;");
+            break;
+        case '\n':
+            WRITE_LITERAL(w, "&#10;");
+            break;
+        case '\t':
+            WRITE_LITERAL(w, "&#9;");
+            break;
+        default:
+            /* A lone byte at the end goes out as it is */
+            if (!s[1]) {
+                PUT(w, 1, (const char *) s);
+                break;
+            }
+            if ((len = write_charref(w, s))) {
+                s += len;
+                continue;
+            }
+            /* libxml2 has its ways with broken UTF-8, so let it go on */
+            if ((rest = xmlBufferCreate())) {
+                xmlAttrSerializeTxtContent(rest, attr->doc, attr, s);
+                PUT(w, xmlBufferLength(rest),
+                    (const char *) xmlBufferContent(rest));
+                xmlBufferFree(rest);
+            }
+            return;
+        }
+        s++;
+    }
+}
+
+/* A namespace URI in whichever quotes it doesn't contain */
+static void write_quoted(serializer *w, const xmlChar *s)
+{
+    const xmlChar *run;
+
+    if (!xmlStrchr(s, '"')) {
+        WRITE_LITERAL(w, "\"");
+        write_string(w, s);
+        WRITE_LITERAL(w, "\"");
+    }
+    else if (!xmlStrchr(s, '\'')) {
+        WRITE_LITERAL(w, "'");
+        write_string(w, s);
+        WRITE_LITERAL(w, "'");
+    }
+    else {
+        WRITE_LITERAL(w, "\"");
+        for (run = s; *s; s++) {
+            if (*s == '"') {
+                PUT(w, s - run, (const char *) run);
+                WRITE_LITERAL(w, "&quot;");
+                run = s + 1;
+            }
+        }
+        PUT(w, s - run, (const char *) run);
+        WRITE_LITERAL(w, "\"");
+    }
+}
+
+static void write_qname(serializer *w, xmlNsPtr ns,
+                        const xmlChar *name)
+{
+    if (ns && ns->prefix) {
+        write_string(w, ns->prefix);
+        WRITE_LITERAL(w, ":");
+    }
+    write_string(w, name);
+}
+
+static void write_start_tag(serializer *w, xmlNodePtr node)
+{
+    xmlNsPtr ns;
+    xmlAttrPtr attr;
+    xmlNodePtr child;
+
+    WRITE_LITERAL(w, "<");
+    write_qname(w, node->ns, node->name);
+    for (ns = node->nsDef; ns; ns = ns->next) {
+        if (ns->type != XML_LOCAL_NAMESPACE || !ns->href
+            || xmlStrEqual(ns->prefix, BAD_CAST "xml"))
+            continue;
+        if (ns->prefix) {
+            WRITE_LITERAL(w, " xmlns:");
+            write_string(w, ns->prefix);
+        }
+        else {
+            WRITE_LITERAL(w, " xmlns");
+        }
+        WRITE_LITERAL(w, "=");
+        write_quoted(w, ns->href);
+    }
+    for (attr = node->properties; attr; attr = attr->next) {
+        WRITE_LITERAL(w, " ");
+        write_qname(w, attr->ns, attr->name);
+        WRITE_LITERAL(w, "=\"");
+        for (child = attr->children; child; child = child->next) {
+            if (child->type == XML_TEXT_NODE) {
+                if (child->content)
+                    write_escaped(w, child->content, attr);
+            }
+            else if (child->type == XML_ENTITY_REF_NODE) {
+                WRITE_LITERAL(w, "&");
+                write_string(w, child->name);
+                WRITE_LITERAL(w, ";");
+            }
+        }
+        WRITE_LITERAL(w, "\"");
+    }
+}
+
+static void write_end_tag(serializer *w, xmlNodePtr node)
+{
+    WRITE_LITERAL(w, "</");
+    write_qname(w, node->ns, node->name);
+    WRITE_LITERAL(w, ">");
+}
+
+static void write_cdata(serializer *w, const xmlChar *s)
+{
+    const xmlChar *start = s;
+
+    if (!s || !*s) {
+        WRITE_LITERAL(w, "<![CDATA[]]>");
+        return;
+    }
+    /* "]]>" can't be in one, so it is split between two */
+    for (; *s; s++) {
+        if (s[0] == ']' && s[1] == ']' && s[2] == '>') {
+            s += 2;
+            WRITE_LITERAL(w, "<![CDATA[");
+            PUT(w, s - start, (const char *) start);
+            WRITE_LITERAL(w, "]]>");
+            start = s;
+        }
+    }
+    if (s != start) {
+        WRITE_LITERAL(w, "<![CDATA[");
+        PUT(w, s - start, (const char *) start);
+        WRITE_LITERAL(w, "]]>");
+    }
+}
+
+/* Write out a child of the document and everything below it */
+static void write_tree(serializer *w, xmlDocPtr doc,
+                       xmlNodePtr root, const char *encoding,
+                       int no_empty)
+{
+    xmlNodePtr cur = root;
+
+    for (;;) {
+        switch (cur->type) {
+        case XML_ELEMENT_NODE:
+            write_start_tag(w, cur);
+            if (cur->children) {
+                WRITE_LITERAL(w, ">");
+                cur = cur->children;
+                continue;
+            }
+            if (no_empty) {
+                WRITE_LITERAL(w, ">");
+                write_end_tag(w, cur);
+            }
+            else {
+                WRITE_LITERAL(w, "/>");
+            }
+            break;
+        case XML_TEXT_NODE:
+            if (!cur->content)
+                break;
+            /* disable-output-escaping */
+            if (cur->name == xmlStringTextNoenc)
+                write_string(w, cur->content);
+            else
+                write_escaped(w, cur->content, NULL);
+            break;
+        case XML_CDATA_SECTION_NODE:
+            write_cdata(w, cur->content);
+            break;
+        case XML_COMMENT_NODE:
+            if (cur->content) {
+                WRITE_LITERAL(w, "<!--");
+                write_string(w, cur->content);
+                WRITE_LITERAL(w, "-->");
+            }
+            break;
+        case XML_PI_NODE:
+            WRITE_LITERAL(w, "<?");
+            write_string(w, cur->name);
+            if (cur->content) {
+                WRITE_LITERAL(w, " ");
+                write_string(w, cur->content);
+            }
+            WRITE_LITERAL(w, "?>");
+            break;
+        case XML_ENTITY_REF_NODE:
+            WRITE_LITERAL(w, "&");
+            write_string(w, cur->name);
+            WRITE_LITERAL(w, ";");
+            break;
+        default:
+            flush(w);
+            xmlNodeDumpOutput(w->out, doc, cur, 0, 0, encoding);
+            break;
+        }
+        while (cur != root && !cur->next) {
+            cur = cur->parent;
+            write_end_tag(w, cur);
+        }
+        if (cur == root)
+            return;
+        cur = cur->next;
+    }
+}
+
+/**
+ * Serialize result as xsltSaveResultTo would.  Returns 0, having written
+ * nothing, if it has to be left to xsltSaveResultTo, and otherwise sets
+ * *length to the bytes written, or -1 on failure.
+ */
+int transform_serialize(xmlOutputBufferPtr out, xmlDocPtr result,
+                        xsltStylesheetPtr style, int *length)
+{
+    const xmlChar *method;
+    const xmlChar *encoding;
+    xmlNodePtr children;
+    xmlNodePtr child;
+    xmlDtdPtr dtd = result->intSubset;
+    int indent;
+    int omit;
+    int standalone;
+    int base;
+    serializer *w;
+
+    if (!serialize_ok || !out || out->encoder
+        || result->type != XML_DOCUMENT_NODE || style->methodURI
+        || !result->children || (result->children->type == XML_DTD_NODE
+                                 && !result->children->next))
+        return 0;
+    XSLT_GET_IMPORT_PTR(method, style, method);
+    XSLT_GET_IMPORT_PTR(encoding, style, encoding);
+    XSLT_GET_IMPORT_INT(indent, style, indent);
+    if ((method && !xmlStrEqual(method, BAD_CAST "xml")) || indent == 1)
+        return 0;
+    if (dtd && xmlIsXHTML(dtd->SystemID, dtd->ExternalID) > 0)
+        return 0;
+
+    if (!(w = malloc(sizeof(*w))))
+        return 0;
+    w->out = out;
+    w->used = 0;
+    base = out->written;
+    XSLT_GET_IMPORT_INT(omit, style, omitXmlDeclaration);
+    XSLT_GET_IMPORT_INT(standalone, style, standalone);
+    if (omit != 1) {
+        WRITE_LITERAL(w, "<?xml version=\"");
+        write_string(w, result->version ? result->version : BAD_CAST "1.0");
+        WRITE_LITERAL(w, "\"");
+        if (!encoding) {
+            if (result->encoding)
+                encoding = result->encoding;
+            else if (result->charset != XML_CHAR_ENCODING_UTF8)
+                encoding = BAD_CAST xmlGetCharEncodingName((xmlCharEncoding)
+                                                           result->charset);
+        }
+        if (encoding) {
+            WRITE_LITERAL(w, " encoding=\"");
+            write_string(w, encoding);
+            WRITE_LITERAL(w, "\"");
+        }
+        if (standalone == 0)
+            WRITE_LITERAL(w, " standalone=\"no\"");
+        else if (standalone == 1)
+            WRITE_LITERAL(w, " standalone=\"yes\"");
+        WRITE_LITERAL(w, "?>\n");
+    }
+
+    /* As xsltSaveResultTo does, so xmlNodeDumpOutput needn't scan them */
+    children = result->children;
+    result->children = NULL;
+    for (child = children; child; child = child->next) {
+        write_tree(w, result, child, (const char *) encoding,
+                   xmlSaveNoEmptyTags);
+        /* indent is -1 unless xsl:output says, and that counts too */
+        if (indent && (child->type == XML_DTD_NODE
+                       || (child->type == XML_COMMENT_NODE && child->next)))
+            WRITE_LITERAL(w, "\n");
+    }
+    if (indent)
+        WRITE_LITERAL(w, "\n");
+    result->children = children;
+
+    flush(w);
+    free(w);
+    xmlOutputBufferFlush(out);
+    *length = out->error ? -1 : out->written - base;
+    return 1;
+}
+
+/* A result with one of everything the serializer handles itself */
+static const char sample_xsl[] =
+    "<xsl:stylesheet version='1.0'"
+    " xmlns:xsl='http://www.w3.org/1999/XSL/Transform'>"
+    "<xsl:output cdata-section-elements='c'%s/>"
+    "<xsl:template match='/'>"
+    "<xsl:comment> c </xsl:comment>"
+    "<xsl:processing-instruction name='p'>d</xsl:processing-instruction>"
+    "<r xmlns='urn:a' xmlns:b='urn:&quot;b&apos;' b:x='&lt;&#10;&#9;&#13;'"
+    " y='&quot;&amp;&gt; &#233;&#x20AC;&#x1F600;'>"
+    "<e/><b:e></b:e><c>x]]&gt;y</c><c/>"
+    "<t>&lt;&amp;&gt;&#13;&#10;&#9;&quot;&#233;&#x20AC;&#x1F600;</t>"
+    "<xsl:text disable-output-escaping='yes'>&lt;n/&gt;</xsl:text>"
+    "</r><xsl:comment/>"
+    "</xsl:template></xsl:stylesheet>";
+
+/* Whether both serializers write out the sample the same */
+static int sample_same(const char *output)
+{
+    char text[sizeof(sample_xsl) + 32];
+    xmlDocPtr xsl_doc;
+    xmlDocPtr in;
+    xmlDocPtr result = NULL;
+    xsltStylesheetPtr style = NULL;
+    xmlBufferPtr ours = xmlBufferCreate();
+    xmlBufferPtr theirs = xmlBufferCreate();
+    xmlOutputBufferPtr out;
+    int length = -1;
+    int same = 0;
+
+    apr_snprintf(text, sizeof(text), sample_xsl, output);
+    if ((xsl_doc = xmlReadMemory(text, strlen(text), NULL, NULL,
+                                 XML_PARSE_NOERROR | XML_PARSE_NOWARNING))
+        && !(style = xsltParseStylesheetDoc(xsl_doc)))
+        xmlFreeDoc(xsl_doc);
+    in = xmlReadMemory("<i/>", 4, NULL, NULL, 0);
+    if (style && in && ours && theirs
+        && (result = xsltApplyStylesheet(style, in, NULL))) {
+        serialize_ok = 1;
+        if ((out = xmlOutputBufferCreateBuffer(ours, NULL))) {
+            transform_serialize(out, result, style, &length);
+            xmlOutputBufferClose(out);
+        }
+        serialize_ok = 0;
+        if ((out = xmlOutputBufferCreateBuffer(theirs, NULL))) {
+            xsltSaveResultTo(out, result, style);
+            xmlOutputBufferClose(out);
+        }
+        same = length >= 0 && xmlBufferLength(ours) == xmlBufferLength(theirs)
+            && !memcmp(xmlBufferContent(ours), xmlBufferContent(theirs),
+                       xmlBufferLength(ours));
+    }
+    if (result)
+        xmlFreeDoc(result);
+    if (in)
+        xmlFreeDoc(in);
+    if (style)
+        xsltFreeStylesheet(style);
+    if (ours)
+        xmlBufferFree(ours);
+    if (theirs)
+        xmlBufferFree(theirs);
+    return same;
+}
+
+apr_status_t transform_serialize_child_init(apr_pool_t *p, server_rec *s)
+{
+#if !defined(__AVX2__) && !defined(__SSE2__)
+    scan_init();
+#endif
+    /* With and without an encoding: attributes are escaped differently */
+    serialize_ok = sample_same(" encoding='UTF-8'") && sample_same("");
+    if (!serialize_ok)
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "mod_transform: this libxml2 serializes differently, "
+                     "NativeOutput is off");
+    return APR_SUCCESS;
+}
+
+/* vim:ai:et:ts=4:nowrap
+ */
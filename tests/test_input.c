@@ -0,0 +1,220 @@
+/**
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* CacheDocuments with a pure stylesheet, outside of httpd
+ *
+ * transform_input.c is built into this program with just enough of the
+ * server around it: a request with the module's notes and configuration,
+ * and an input callback standing in for transform_get_input, so the
+ * document loader sees which files document() read.  The same stylesheet
+ * is applied twice, the way apply_stages does it; the first transform
+ * keeps the catalog and its keys, the second is handed them.
+ */
+
+#include "mod_transform_private.h"
+#include "apr_general.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libxslt/xsltInternals.h>
+
+module AP_MODULE_DECLARE_DATA transform_module;
+
+static request_rec *current;
+
+/* The parts of httpd and the module transform_input.c uses */
+
+char *ap_make_dirstr_parent(apr_pool_t *p, const char *s)
+{
+    const char *last = strrchr(s, '/');
+
+    return last ? apr_pstrndup(p, s, last - s + 1) : apr_pstrdup(p, "");
+}
+
+void transform_add_dep(request_rec *r, const char *filename)
+{
+    transform_notes *notes = ap_get_module_config(r->request_config,
+                                                  &transform_module);
+
+    if (!notes)
+        return;
+    if (!notes->deps)
+        notes->deps = apr_array_make(r->pool, 4, sizeof(const char *));
+    APR_ARRAY_PUSH(notes->deps, const char *) =
+        filename ? apr_pstrdup(r->pool, filename) : NULL;
+}
+
+void transform_cache_release(transform_xslt_entry * entry)
+{
+    apr_atomic_dec32(&entry->refcount);
+}
+
+/* Note what is read, and let libxml2's own callbacks read it */
+static int input_match(const char *filename)
+{
+    if (current)
+        transform_add_dep(current, filename);
+    return 0;
+}
+
+static void *input_open(const char *filename)
+{
+    return NULL;
+}
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "test_input: %s\n", what);
+    return 1;
+}
+
+static const char catalog[] =
+    "<catalog><item id=\"a\">first</item><item id=\"b\">second</item>"
+    "</catalog>\n";
+
+static const char stylesheet[] =
+    "<xsl:stylesheet version=\"1.0\""
+    " xmlns:xsl=\"http://www.w3.org/1999/XSL/Transform\">"
+    "<xsl:key name=\"item\" match=\"item\" use=\"@id\"/>"
+    "<xsl:template match=\"/\">"
+    "<xsl:variable name=\"id\" select=\"string(page/@item)\"/>"
+    "<xsl:for-each select=\"document('%s')\">"
+    "<out><xsl:value-of select=\"key('item', $id)\"/></out>"
+    "</xsl:for-each>"
+    "</xsl:template>"
+    "</xsl:stylesheet>";
+
+/* One request, as apply_stages runs a stage */
+static int run(apr_pool_t *pool, server_rec *s, void **dir_configs,
+               transform_xslt_entry * entry, int expect_attached)
+{
+    void *request_configs[1];
+    transform_notes notes;
+    request_rec r;
+    xsltTransformContextPtr tcontext;
+    apr_array_header_t *attached;
+    xmlDocPtr doc;
+    xmlDocPtr result;
+    xmlChar *text = NULL;
+    int size = 0;
+    int failed = 0;
+
+    memset(&r, 0, sizeof(r));
+    memset(&notes, 0, sizeof(notes));
+    apr_pool_create(&r.pool, pool);
+    r.server = s;
+    r.filename = "/page.xml";
+    r.uri = "/page.xml";
+    request_configs[0] = &notes;
+    r.request_config = (ap_conf_vector_t *) request_configs;
+    r.per_dir_config = (ap_conf_vector_t *) dir_configs;
+
+    doc = xmlReadMemory("<page item=\"b\"/>", 16, "page.xml", NULL, 0);
+    tcontext = xsltNewTransformContext(entry->transform, doc);
+    tcontext->xpathCtxt->userData = &r;
+    attached = transform_input_attach(&r, tcontext, entry);
+    if (!attached)
+        failed = fail("nothing to attach to");
+    else if (attached->nelts != expect_attached)
+        failed = fail("wrong number of documents attached");
+
+    current = &r;
+    result = xsltApplyStylesheetUser(entry->transform, doc, NULL, NULL,
+                                     NULL, tcontext);
+    current = NULL;
+    transform_input_finish(&r, tcontext, entry, attached, result != NULL);
+
+    if (!result)
+        failed = fail("transform failed");
+    else {
+        xsltSaveResultToString(&text, &size, result, entry->transform);
+        if (!text || !strstr((const char *) text, "<out>second</out>"))
+            failed = fail("wrong result");
+        xmlFree(text);
+        xmlFreeDoc(result);
+    }
+    if (notes.loaded)
+        failed = fail("loaded documents left in the notes");
+    xmlFreeDoc(doc);
+    apr_pool_destroy(r.pool);
+    return failed;
+}
+
+int main(int argc, const char *const *argv)
+{
+    apr_pool_t *pool;
+    server_rec server;
+    svr_cfg sconf;
+    dir_cfg dconf;
+    void *server_configs[1];
+    void *dir_configs[1];
+    transform_xslt_entry entry;
+    char dir[] = "/tmp/test_inputXXXXXX";
+    const char *path;
+    const char *text;
+    xmlDocPtr sdoc;
+    FILE *fp;
+    int failed = 0;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&pool, NULL);
+    /* Before ours, or libxml2 leaves its own callbacks out */
+    xmlInitParser();
+    xmlRegisterInputCallbacks(input_match, input_open, NULL, NULL);
+
+    if (!mkdtemp(dir))
+        return fail("can't make a directory");
+    path = apr_pstrcat(pool, dir, "/catalog.xml", NULL);
+    if (!(fp = fopen(path, "w")))
+        return fail("can't write the catalog");
+    fputs(catalog, fp);
+    fclose(fp);
+
+    memset(&server, 0, sizeof(server));
+    memset(&sconf, 0, sizeof(sconf));
+    memset(&dconf, 0, sizeof(dconf));
+    server_configs[0] = &sconf;
+    server.module_config = (ap_conf_vector_t *) server_configs;
+    server.server_hostname = "localhost";
+    dconf.opts = CACHE_DOCUMENTS;
+    dir_configs[0] = &dconf;
+    transform_input_child_init(pool, &server);
+
+    text = apr_psprintf(pool, stylesheet, path);
+    sdoc = xmlReadMemory(text, strlen(text), "test.xsl", NULL, 0);
+    memset(&entry, 0, sizeof(entry));
+    entry.transform = xsltParseStylesheetDoc(sdoc);
+    entry.pure = 1;
+    entry.refcount = 1;
+    if (!entry.transform)
+        return fail("can't compile the stylesheet");
+
+    /* The first keeps the catalog, the second is handed it */
+    failed |= run(pool, &server, dir_configs, &entry, 0);
+    failed |= run(pool, &server, dir_configs, &entry, 1);
+    if (entry.refcount != 2)
+        failed |= fail("the kept catalog doesn't hold the stylesheet");
+
+    remove(path);
+    remove(dir);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return failed;
+}
@@ -0,0 +1,353 @@
+/**
+ *    Copyright (c) 2004 Edward Rudd
+ *    Copyright (c) 2004 Paul Querna
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* The native serializer against libxml2's
+ *
+ * Generates random documents, with everything the scans stop at in text
+ * and attributes (markup characters, CR, LF, TAB, non-ASCII up to four
+ * byte sequences, "]]>"), namespaces, CDATA, comments and processing
+ * instructions, and copies each through a stylesheet with one of a set
+ * of xsl:output variations.  Every result has to come out of
+ * transform_serialize, or its fallback to xsltSaveResultTo, the same as
+ * out of xsltSaveResultTo.
+ *
+ * The build runs this once for each scan: the one the compiler picks by
+ * default, and on x86 also the scalar, SSE2 and AVX2 ones.
+ *
+ * Usage: test_serialize [cases [seed]], 300 cases from seed 1 by default.
+ * A failing case is printed with both outputs and can be run again
+ * alone with "test_serialize 1 <its seed>".
+ */
+
+#include "mod_transform_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libxslt/xsltInternals.h>
+
+/* Exit status automake takes as a skipped test */
+#define SKIPPED 77
+
+#ifdef APLOG_MODULE_INDEX
+void ap_log_error_(const char *file, int line, int module_index, int level,
+                   apr_status_t status, const server_rec *s,
+                   const char *fmt, ...)
+#else
+void ap_log_error(const char *file, int line, int level, apr_status_t status,
+                  const server_rec *s, const char *fmt, ...)
+#endif
+{
+    fprintf(stderr, "test_serialize: %s\n", fmt);
+}
+
+static unsigned long seed;
+
+/* 0 to n - 1 */
+static int pick(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (int) ((seed >> 16) % n);
+}
+
+static int chance(int percent)
+{
+    return pick(100) < percent;
+}
+
+static const char *const pieces[] = {
+    "a", "b", "c", " ", "x", "y", "z", "<", ">", "&", "\"", "'", "\r",
+    "\n", "\t", "]", "]", ">", "\xC3\xA9", "\xE2\x82\xAC",
+    "\xF0\x9F\x98\x80", "\xC2\xA0", "&amp;"
+};
+
+/* Up to max pieces of text, none of them in leave_out */
+static void text(xmlBufferPtr buf, int max, const char *leave_out)
+{
+    int n = pick(max + 1);
+    const char *piece;
+
+    while (n--) {
+        piece = pieces[pick(sizeof(pieces) / sizeof(pieces[0]))];
+        if (!leave_out || !strchr(leave_out, *piece))
+            xmlBufferCCat(buf, piece);
+    }
+}
+
+static void escaped(xmlBufferPtr buf, int max, int attr)
+{
+    xmlBufferPtr raw = xmlBufferCreate();
+    const char *c;
+
+    text(raw, max, NULL);
+    for (c = (const char *) xmlBufferContent(raw); *c; c++) {
+        switch (*c) {
+        case '&':
+            xmlBufferCCat(buf, "&amp;");
+            break;
+        case '<':
+            xmlBufferCCat(buf, "&lt;");
+            break;
+        case '>':
+            xmlBufferCCat(buf, "&gt;");
+            break;
+        case '\r':
+            xmlBufferCCat(buf, "&#13;");
+            break;
+        case '"':
+            xmlBufferCCat(buf, attr ? "&quot;" : "\"");
+            break;
+        case '\n':
+            xmlBufferCCat(buf, attr ? "&#10;" : "\n");
+            break;
+        case '\t':
+            xmlBufferCCat(buf, attr ? "&#9;" : "\t");
+            break;
+        default:
+            xmlBufferAdd(buf, (const xmlChar *) c, 1);
+        }
+    }
+    xmlBufferFree(raw);
+}
+
+static void element(xmlBufferPtr buf, int depth)
+{
+    static const char *const names[] = { "a", "b", "p:c", "q:d", "e" };
+    const char *attrs[] = { "x", "y", "p:z", "w" };
+    const char *name = names[pick(5)];
+    xmlBufferPtr body = xmlBufferCreate();
+    int i;
+    int n;
+
+    xmlBufferCCat(buf, "<");
+    xmlBufferCCat(buf, name);
+    for (i = 0, n = pick(4); i < n; i++) {
+        int j = i + pick(4 - i);
+        const char *attr = attrs[j];
+
+        attrs[j] = attrs[i];
+        xmlBufferCCat(buf, " ");
+        xmlBufferCCat(buf, attr);
+        xmlBufferCCat(buf, "=\"");
+        escaped(buf, 30, 1);
+        xmlBufferCCat(buf, "\"");
+    }
+    if (chance(30)) {
+        char ns[32];
+
+        snprintf(ns, sizeof(ns), " xmlns=\"urn:def%d\"", pick(3));
+        xmlBufferCCat(buf, ns);
+    }
+    if (chance(20))
+        xmlBufferCCat(buf, " xmlns:r=\"urn:r'q\"");
+
+    for (i = 0, n = depth < 5 ? pick(6) : 0; i < n; i++) {
+        int what = pick(10);
+
+        if (what < 4)
+            element(body, depth + 1);
+        else if (what < 7)
+            escaped(body, 60, 0);
+        else if (what < 8) {
+            xmlBufferCCat(body, "<![CDATA[");
+            text(body, 60, "]");
+            xmlBufferCCat(body, "]]>");
+        }
+        else if (what < 9) {
+            xmlBufferCCat(body, "<!--");
+            text(body, 10, "\r");
+            xmlBufferCCat(body, "-->");
+        }
+        else {
+            char pi[32];
+
+            snprintf(pi, sizeof(pi), "<?pi%d ", depth);
+            xmlBufferCCat(body, pi);
+            text(body, 8, "?\r");
+            xmlBufferCCat(body, "?>");
+        }
+    }
+    if (!xmlBufferLength(body) && chance(50))
+        xmlBufferCCat(buf, "/>");
+    else {
+        xmlBufferCCat(buf, ">");
+        xmlBufferAdd(buf, xmlBufferContent(body), xmlBufferLength(body));
+        xmlBufferCCat(buf, "</");
+        xmlBufferCCat(buf, name);
+        xmlBufferCCat(buf, ">");
+    }
+    xmlBufferFree(body);
+}
+
+static const char *const outputs[] = {
+    "",
+    "<xsl:output method=\"xml\"/>",
+    "<xsl:output encoding=\"UTF-8\"/>",
+    "<xsl:output encoding=\"ISO-8859-1\"/>",
+    "<xsl:output omit-xml-declaration=\"yes\"/>",
+    "<xsl:output standalone=\"yes\"/>",
+    "<xsl:output standalone=\"no\" indent=\"no\"/>",
+    "<xsl:output doctype-system=\"about:legacy-compat\"/>",
+    "<xsl:output doctype-public=\"-//X//Y\" doctype-system=\"x.dtd\"/>",
+    "<xsl:output cdata-section-elements=\"a e\"/>",
+    "<xsl:output indent=\"yes\"/>",
+    "<xsl:output method=\"html\"/>",
+    "<xsl:output version=\"1.1\"/>",
+    "<xsl:output doctype-public=\"-//W3C//DTD XHTML 1.0 Strict//EN\""
+        " doctype-system=\"http://www.w3.org/TR/xhtml1/DTD/"
+        "xhtml1-strict.dtd\"/>"
+};
+
+static void stylesheet(xmlBufferPtr buf)
+{
+    int extra = pick(5);
+
+    xmlBufferCCat(buf, "<xsl:stylesheet version=\"1.0\""
+                  " xmlns:xsl=\"http://www.w3.org/1999/XSL/Transform\">");
+    xmlBufferCCat(buf, outputs[pick(sizeof(outputs) / sizeof(outputs[0]))]);
+    if (extra == 1) {
+        xmlBufferCCat(buf, "<xsl:template match=\"e\"><xsl:copy>"
+                      "<xsl:attribute name=\"g\">");
+        escaped(buf, 20, 0);
+        xmlBufferCCat(buf, "</xsl:attribute><xsl:value-of select=\".\""
+                      " disable-output-escaping=\"yes\"/></xsl:copy>"
+                      "</xsl:template>");
+    }
+    else if (extra == 2)
+        xmlBufferCCat(buf, "<xsl:template match=\"/\">"
+                      "<xsl:comment>top</xsl:comment><xsl:apply-templates/>"
+                      "<xsl:comment>end</xsl:comment></xsl:template>");
+    else if (extra == 3)
+        xmlBufferCCat(buf, "<xsl:template match=\"/\"><xsl:apply-templates/>"
+                      "<xsl:processing-instruction name=\"tail\"/>"
+                      "</xsl:template>");
+    else if (extra == 4)
+        xmlBufferCCat(buf, "<xsl:template match=\"/\"><xsl:apply-templates/>"
+                      "<xsl:comment/></xsl:template>");
+    xmlBufferCCat(buf, "<xsl:template match=\"@*|node()\"><xsl:copy>"
+                  "<xsl:apply-templates select=\"@*|node()\"/></xsl:copy>"
+                  "</xsl:template></xsl:stylesheet>");
+}
+
+static void document(xmlBufferPtr buf)
+{
+    xmlBufferCCat(buf, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                  "<root xmlns:p=\"urn:p\" xmlns:q=\"urn:q\">");
+    element(buf, 0);
+    xmlBufferCCat(buf, "</root>");
+}
+
+/* Whether the case from seed serializes the same both ways */
+static int same(unsigned long from, int *native)
+{
+    xmlBufferPtr xsl = xmlBufferCreate();
+    xmlBufferPtr xml = xmlBufferCreate();
+    xmlBufferPtr ours = xmlBufferCreate();
+    xmlBufferPtr theirs = xmlBufferCreate();
+    xsltStylesheetPtr style = NULL;
+    xmlOutputBufferPtr out;
+    xmlDocPtr sdoc;
+    xmlDocPtr in = NULL;
+    xmlDocPtr result = NULL;
+    int length = -1;
+    int expected;
+    int ok = 0;
+
+    seed = from;
+    stylesheet(xsl);
+    document(xml);
+    if ((sdoc = xmlReadMemory((const char *) xmlBufferContent(xsl),
+                              xmlBufferLength(xsl), "case.xsl", NULL, 0)))
+        style = xsltParseStylesheetDoc(sdoc);
+    if (style)
+        in = xmlReadMemory((const char *) xmlBufferContent(xml),
+                           xmlBufferLength(xml), "case.xml", NULL, 0);
+    if (in)
+        result = xsltApplyStylesheet(style, in, NULL);
+    if (!result)
+        fprintf(stderr, "case %lu: can't transform\n", from);
+    else {
+        out = xmlOutputBufferCreateBuffer(ours, NULL);
+        if ((*native = transform_serialize(out, result, style, &length))
+            == 0)
+            length = xsltSaveResultTo(out, result, style);
+        xmlOutputBufferClose(out);
+        out = xmlOutputBufferCreateBuffer(theirs, NULL);
+        expected = xsltSaveResultTo(out, result, style);
+        xmlOutputBufferClose(out);
+
+        ok = length == expected
+            && xmlBufferLength(ours) == xmlBufferLength(theirs)
+            && !memcmp(xmlBufferContent(ours), xmlBufferContent(theirs),
+                       xmlBufferLength(ours));
+        if (!ok)
+            fprintf(stderr, "case %lu: %d bytes, libxml2 %d\n"
+                    "--- stylesheet\n%s\n--- document\n%s\n"
+                    "--- ours\n%s\n--- libxml2\n%s\n", from, length,
+                    expected, xmlBufferContent(xsl), xmlBufferContent(xml),
+                    xmlBufferContent(ours), xmlBufferContent(theirs));
+    }
+
+    if (result)
+        xmlFreeDoc(result);
+    if (in)
+        xmlFreeDoc(in);
+    if (style)
+        xsltFreeStylesheet(style);
+    xmlBufferFree(xsl);
+    xmlBufferFree(xml);
+    xmlBufferFree(ours);
+    xmlBufferFree(theirs);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int cases = argc > 1 ? atoi(argv[1]) : 300;
+    unsigned long from = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    int native;
+    int handled = 0;
+    int bad = 0;
+    int i;
+
+#if defined(__AVX2__) && defined(__GNUC__)
+    if (!__builtin_cpu_supports("avx2")) {
+        fprintf(stderr, "test_serialize: no AVX2 here\n");
+        return SKIPPED;
+    }
+#endif
+    transform_serialize_child_init(NULL, NULL);
+
+    /* Each case starts from the seed the one before left */
+    for (i = 0; i < cases; i++) {
+        native = 0;
+        if (!same(from, &native))
+            bad++;
+        handled += native;
+        from = seed;
+    }
+    printf("%d cases, %d native, %d bad\n", cases, handled, bad);
+
+    xsltCleanupGlobals();
+    xmlCleanupParser();
+    if (bad)
+        return 1;
+    /* libxml2 serializes differently, and NativeOutput would be off */
+    return handled ? 0 : SKIPPED;
+}